@@ -7,17 +7,75 @@
 #define INFO(...) do {fprintf(stderr, "[          ] [ INFO ] "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); fflush(stderr);} while(0)
 #define ERROR(...) do {fprintf(stderr, "[          ] [ ERR  ] "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); fflush(stderr);} while(0) 
 
+// Orders an Image can keep its pixels in. IMAGE_TILED stores each
+// IMAGE_TILE_SIDE x IMAGE_TILE_SIDE block as one 64-byte run, blocks in
+// row-major order, with the right and bottom edges padded to whole blocks.
+typedef enum ImageLayout {
+    IMAGE_ROW_MAJOR = 0,
+    IMAGE_TILED = 1
+} ImageLayout;
+
+#define IMAGE_TILE_SIDE 8
+
+// Images come from create_image or the loaders, which set every field. An
+// Image filled in by hand must set layout as well, to IMAGE_ROW_MAJOR for
+// pixels in plain row-major order.
 typedef struct Image {
-    unsigned char *pixels;  // Pixel data in row-major order
-    unsigned short width;   // Image width
-    unsigned short height;  // Image height
+    unsigned char *pixels;  // Pixel data, in the order given by layout
+    unsigned int width;     // Image width
+    unsigned int height;    // Image height
+    ImageLayout layout;     // IMAGE_ROW_MAJOR unless set_image_layout changed it
 } Image;
 
+// Pixels of a binary P5 or P6 file mapped into memory instead of loaded, so
+// images larger than memory can be read a region at a time. Pixel (row, col)
+// is pixels[row * row_stride + col * step]; for P6, step is 3 and only the
+// red channel is read, as load_image does.
+typedef struct MappedImage {
+    const unsigned char *pixels;
+    size_t row_stride;
+    unsigned int step;
+    unsigned int width;
+    unsigned int height;
+    const char *file_data;  // Whole file, released by unmap_image
+    size_t file_size;
+    int file_mapped;
+} MappedImage;
+
+// Netpbm encodings. load_image accepts all three; the writers emit any of them.
+typedef enum PNMFormat {
+    PNM_P3 = 3,     // ASCII PPM, intensity repeated in all three channels
+    PNM_P5 = 5,     // Binary PGM, one byte per pixel
+    PNM_P6 = 6      // Binary PPM, intensity repeated in all three channels
+} PNMFormat;
+
 Image *load_image(char *filename);
+// load_image with large P3 bodies parsed by nthreads threads (0 means one per
+// online CPU). Accepts and rejects exactly the files load_image does.
+Image *load_image_parallel(char *filename, unsigned int nthreads);
+int save_image(Image *image, char *filename, PNMFormat format);
+int save_pnm(char *filename, unsigned char *pixels, unsigned int width,
+             unsigned int height, PNMFormat format);
+// save_pnm with the P3 text formatting, or the expansion of pixels into P6
+// triples, split over nthreads threads (0 means one per online CPU). The
+// bytes written are the same.
+int save_pnm_parallel(char *filename, unsigned char *pixels, unsigned int width,
+                      unsigned int height, PNMFormat format, unsigned int nthreads);
+// Row-major image with uninitialized pixels, released by delete_image.
+// NULL for a zero side or when out of memory.
+Image *create_image(unsigned int width, unsigned int height);
 void delete_image(Image *image);
+// NULL for P3 files, which cannot be addressed by position.
+MappedImage *map_image(char *filename);
+void unmap_image(MappedImage *image);
+// Reorders the pixels in place. Returns 0, leaving the image as it was, if
+// the new buffer could not be allocated.
+int set_image_layout(Image *image, ImageLayout layout);
 unsigned char get_image_intensity(Image *image, unsigned int row, unsigned int col);
-unsigned short get_image_width(Image *image);
-unsigned short get_image_height(Image *image);
+// Copies the width pixels of row into out, whatever the layout.
+void get_image_row(Image *image, unsigned int row, unsigned char *out);
+unsigned int get_image_width(Image *image);
+unsigned int get_image_height(Image *image);
 unsigned int hide_message(char *message, char *input_filename, char *output_filename);
 char *reveal_message(char *input_filename);
 unsigned int hide_image(char *secret_image_filename, char *input_filename, char *output_filename);
@@ -7,8 +7,12 @@
 #define INFO(...) do {fprintf(stderr, "[          ] [ INFO ] "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); fflush(stderr);} while(0)
 #define ERROR(...) do {fprintf(stderr, "[          ] [ ERR  ] "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); fflush(stderr);} while(0) 
 
+// Nodes the builders and loaders return live in slabs owned by their tree,
+// which slab_shift records. Nodes for trees assembled by hand come from
+// create_qtree_node, or otherwise must have slab_shift set to 0.
 typedef struct QTNode {
     unsigned char intensity;
+    unsigned char slab_shift;   // 0 for a node allocated on its own
     unsigned int row;
     unsigned int col;
     unsigned int width;
@@ -19,15 +23,196 @@ typedef struct QTNode {
     struct QTNode *child4;
 } QTNode;
 
+// Pointerless form of a tree shaped by split_region: nodes in preorder with
+// one intensity byte and the size of their subtree, 5 bytes per node. A
+// node's first child follows it and each further child follows the previous
+// child's subtree; geometry is recomputed from the root size on the way down.
+typedef struct QTLinearTree {
+    unsigned int width;
+    unsigned int height;
+    size_t count;
+    size_t capacity;
+    unsigned char *intensity;
+    uint32_t *subtree;      // Nodes in the subtree rooted here; 1 for leaves
+} QTLinearTree;
+
+// Position in a QTLinearTree, the counterpart of a QTNode pointer. index is
+// QT_LINEAR_NONE for absent children.
+typedef struct QTLinearNode {
+    size_t index;
+    unsigned int row;
+    unsigned int col;
+    unsigned int height;
+    unsigned int width;
+} QTLinearNode;
+
+#define QT_LINEAR_NONE ((size_t)-1)
+
+// Quadtree with structurally identical subtrees stored once. Nodes carry no
+// geometry: a node's rectangle follows from its parent's by split_region, so
+// one node can stand for any number of places in the image. Children come
+// before their parents and the root is the last node.
+typedef struct QTDagNode {
+    uint32_t child[4];      // child1..child4, QT_DAG_NONE where absent
+    unsigned char intensity;
+} QTDagNode;
+
+#define QT_DAG_NONE UINT32_MAX
+
+typedef struct QTDag {
+    unsigned int width;
+    unsigned int height;
+    size_t count;
+    size_t capacity;
+    QTDagNode *nodes;
+} QTDag;
+
+// Writer and reader of image sequences in which every frame's tree is
+// stored as its differences from the previous frame's.
+typedef struct QTSequenceWriter QTSequenceWriter;
+typedef struct QTSequenceReader QTSequenceReader;
+
+// Full-depth tree of an image with the RMSE of every node, from which the
+// tree for any max_rmse is cut without rebuilding. image is kept to settle
+// RMSEs within rounding distance of a threshold the way create_quadtree
+// does, so it must outlive the multi tree.
+typedef struct QTMultiTree {
+    QTLinearTree *tree;     // The tree create_linear_quadtree builds at max_rmse 0
+    double *rmse;           // Per node, in the same preorder
+    Image *image;
+} QTMultiTree;
+
 QTNode *create_quadtree(Image *image, double max_rmse);
+QTNode *create_quadtree_parallel(Image *image, double max_rmse, unsigned int nthreads);
+// create_quadtree without summed-area tables: region totals are merged up
+// from 2x2 blocks and children are dropped again under regions that do
+// not split. Same trees, with no memory beyond the nodes.
+QTNode *create_quadtree_bottom_up(Image *image, double max_rmse);
+// create_quadtree for a binary P5 or P6 file too large to load. The file is
+// mapped and the tree built one tile of at most tile_pixels pixels (0 for a
+// default of 1M) at a time, so only one tile's pixels and summed-area tables
+// are ever held in memory.
+QTNode *create_quadtree_tiled(char *filename, double max_rmse, size_t tile_pixels);
+// Tree of at most max_nodes nodes, grown by always splitting the leaf with the
+// largest squared error. Without a binding budget it equals
+// create_quadtree(image, 0).
+QTNode *create_quadtree_budget(Image *image, size_t max_nodes);
 QTNode *get_child1(QTNode *node);
 QTNode *get_child2(QTNode *node);
 QTNode *get_child3(QTNode *node);
 QTNode *get_child4(QTNode *node);
 unsigned char get_node_intensity(QTNode *node);
+// Leaf allocated on its own, for assembling trees by hand; NULL when out of
+// memory.
+QTNode *create_qtree_node(unsigned char intensity, unsigned int row, unsigned int col,
+                          unsigned int height, unsigned int width);
+// Frees root and everything below it, which may be any subtree. A whole tree
+// from this module goes in one release of its slabs; part of one is kept for
+// reuse by the rest, and the slabs go once none of their nodes is left.
 void delete_quadtree(QTNode *root);
 void save_qtree_as_ppm(QTNode *root, char *filename);
+void save_qtree_as_pnm(QTNode *root, char *filename, PNMFormat format);
+// Paints the leaves into a caller-owned root->height by root->width raster
+// whose rows are stride bytes apart. Nothing is allocated, and pixels no
+// leaf covers keep their value.
+int qtree_render(QTNode *root, unsigned char *pixels, size_t stride);
+// Parallel versions of qtree_render and save_qtree_as_pnm over nthreads
+// threads (0 means one per online CPU), with identical results.
+int qtree_render_parallel(QTNode *root, unsigned char *pixels, size_t stride,
+                          unsigned int nthreads);
+int save_qtree_as_pnm_parallel(QTNode *root, char *filename, PNMFormat format,
+                               unsigned int nthreads);
+// Brings a tree built at max_rmse up to date with image after changes inside
+// the given rectangle only, clipped to the image. Subtrees clear of it are
+// kept, and the totals of their regions are cached in the tree's arena for
+// the next update. Nodes an update drops, and their cached totals, are
+// reused by later updates, so repeated edits run in bounded memory. The
+// result is the tree create_quadtree(image, max_rmse) would build. Returns 0
+// on failure, after which the tree must be rebuilt.
+int qtree_update(QTNode *root, Image *image, unsigned int row, unsigned int col,
+                 unsigned int height, unsigned int width, double max_rmse);
+unsigned char qtree_sample(QTNode *root, unsigned int row, unsigned int col);
+void qtree_sample_batch(QTNode *root, const unsigned int *rows, const unsigned int *cols,
+                        size_t count, unsigned char *out);
+int qtree_render_region(QTNode *root, unsigned int row, unsigned int col,
+                        unsigned int height, unsigned int width, unsigned char *buf);
+// Reduced renderings: nodes at depth max_depth (the root is depth 0) count as
+// leaves, and the image is drawn straight onto a width by height grid. Each
+// output pixel samples the source at its center, and stops at the first
+// node that covers nothing but that pixel, taking its mean intensity. Work
+// follows the output size. QT_FULL_DEPTH at the source size reproduces
+// save_qtree_as_pnm.
+#define QT_FULL_DEPTH ((unsigned int)-1)
+int qtree_render_lod(QTNode *root, unsigned int max_depth, unsigned int width,
+                     unsigned int height, unsigned char *pixels);
+int save_qtree_as_pnm_lod(QTNode *root, char *filename, PNMFormat format,
+                          unsigned int max_depth, unsigned int width, unsigned int height);
 QTNode *load_preorder_qt(char *filename);
 void save_preorder_qt(QTNode *root, char *filename);
+int save_preorder_qt_binary(QTNode *root, char *filename);
+QTNode *load_preorder_qt_binary(char *filename);
+// Same files as create_quadtree followed by save_preorder_qt or
+// save_preorder_qt_binary, written while the splits are decided and without
+// allocating any nodes. Return 0 on failure.
+int encode_preorder_qt(Image *image, double max_rmse, char *filename);
+int encode_preorder_qt_binary(Image *image, double max_rmse, char *filename);
+// Writes the image of a text or binary preorder tree file without building
+// the tree: leaves are painted into the raster as they are read.
+int render_preorder_qt(char *tree_filename, char *image_filename, PNMFormat format);
+int save_preorder_qt_compressed(QTNode *root, char *filename);
+QTNode *load_preorder_qt_compressed(char *filename);
+
+QTLinearTree *create_linear_quadtree(Image *image, double max_rmse);
+// NULL if root does not follow split_region.
+QTLinearTree *linear_from_quadtree(QTNode *root);
+QTNode *quadtree_from_linear(QTLinearTree *tree);
+void delete_linear_quadtree(QTLinearTree *tree);
+QTLinearNode get_linear_root(QTLinearTree *tree);
+QTLinearNode get_linear_child1(QTLinearTree *tree, QTLinearNode node);
+QTLinearNode get_linear_child2(QTLinearTree *tree, QTLinearNode node);
+QTLinearNode get_linear_child3(QTLinearTree *tree, QTLinearNode node);
+QTLinearNode get_linear_child4(QTLinearTree *tree, QTLinearNode node);
+unsigned char get_linear_intensity(QTLinearTree *tree, QTLinearNode node);
+int save_linear_qtree_as_pnm(QTLinearTree *tree, char *filename, PNMFormat format);
+
+QTMultiTree *create_multi_quadtree(Image *image);
+void delete_multi_quadtree(QTMultiTree *multi);
+// Same trees and images as create_quadtree(image, max_rmse).
+QTNode *extract_quadtree(QTMultiTree *multi, double max_rmse);
+QTLinearTree *extract_linear_quadtree(QTMultiTree *multi, double max_rmse);
+int save_multi_qtree_as_pnm(QTMultiTree *multi, double max_rmse, char *filename,
+                            PNMFormat format);
+
+// Merges identical subtrees of a tree. NULL if root does not follow
+// split_region.
+QTDag *dag_from_quadtree(QTNode *root);
+QTNode *quadtree_from_dag(QTDag *dag);
+void delete_dag_quadtree(QTDag *dag);
+int save_dag_qtree_as_pnm(QTDag *dag, char *filename, PNMFormat format);
+int save_dag_qtree(QTDag *dag, char *filename);
+QTDag *load_dag_qtree(char *filename);
+
+// Frames must all be width by height and follow split_region. Unchanged
+// subtrees cost two bits each.
+QTSequenceWriter *open_qtree_sequence_writer(char *filename, unsigned int width,
+                                             unsigned int height);
+int write_qtree_sequence_frame(QTSequenceWriter *writer, QTNode *root);
+int close_qtree_sequence_writer(QTSequenceWriter *writer);
+QTSequenceReader *open_qtree_sequence_reader(char *filename);
+// The next frame, owned by the reader and valid until the next call. NULL
+// after the last frame or at the first corrupt one; quadtree_from_linear
+// gives a QTNode copy.
+QTLinearTree *read_qtree_sequence_frame(QTSequenceReader *reader);
+void close_qtree_sequence_reader(QTSequenceReader *reader);
+
+// Lossless archive of an image: the tree create_quadtree(image, max_rmse)
+// builds, coded as by save_preorder_qt_compressed, followed by every pixel's
+// difference from that tree's rendering. Each difference is predicted from
+// its left and upper neighbours and the error entropy-coded in the context of
+// their size. load_lossless_qt returns the exact image, and
+// load_lossless_qt_base just the tree, which decodes without the residuals.
+int save_lossless_qt(Image *image, double max_rmse, char *filename);
+Image *load_lossless_qt(char *filename);
+QTNode *load_lossless_qt_base(char *filename);
 
 #endif // QTREE_H
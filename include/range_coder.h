@@ -0,0 +1,50 @@
+#ifndef RANGE_CODER_H
+#define RANGE_CODER_H
+#include <stddef.h>
+#include <stdint.h>
+
+// Adaptive binary range coder. Each RCProb is the estimated probability of
+// a 0 bit in units of 1/2048 and moves towards every bit coded with it, so
+// callers model their data by choosing which RCProb codes each bit.
+typedef uint16_t RCProb;
+
+#define RC_PROB_BITS 11
+#define RC_PROB_INIT (1 << (RC_PROB_BITS - 1))
+
+// Encodes into a growable heap buffer.
+typedef struct RangeEncoder {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    uint64_t low;
+    uint32_t range;
+    unsigned char cache;
+    uint64_t cache_size;
+    int failed;             // Set when the buffer could not grow
+} RangeEncoder;
+
+typedef struct RangeDecoder {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    uint32_t range;
+    uint32_t code;
+    int overrun;            // Set when decoding ran past the end of data
+} RangeDecoder;
+
+void rc_init_probs(RCProb *probs, size_t count);
+
+void rc_encoder_init(RangeEncoder *encoder);
+void rc_encode_bit(RangeEncoder *encoder, RCProb *prob, int bit);
+// Codes the low nbits of value MSB first through a binary tree of
+// probabilities; probs must hold 1 << nbits entries.
+void rc_encode_tree(RangeEncoder *encoder, RCProb *probs, int nbits, unsigned int value);
+// Flushes the coder. Returns 0 if any allocation failed along the way.
+int rc_encoder_finish(RangeEncoder *encoder);
+void rc_encoder_free(RangeEncoder *encoder);
+
+void rc_decoder_init(RangeDecoder *decoder, const unsigned char *data, size_t size);
+int rc_decode_bit(RangeDecoder *decoder, RCProb *prob);
+unsigned int rc_decode_tree(RangeDecoder *decoder, RCProb *probs, int nbits);
+
+#endif // RANGE_CODER_H
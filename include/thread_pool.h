@@ -0,0 +1,25 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+#include <stddef.h>
+
+// Fixed-size pool of worker threads. Every worker owns a deque: tasks
+// submitted from inside a task go to the bottom of the submitter's deque and
+// are popped LIFO, while idle workers steal FIFO from the top of the others.
+typedef struct ThreadPool ThreadPool;
+
+typedef void (*ThreadPoolTask)(void *arg);
+
+// Creates a pool with nthreads workers (0 means one per online CPU).
+ThreadPool *thread_pool_create(unsigned int nthreads);
+unsigned int thread_pool_size(ThreadPool *pool);
+// Index of the calling worker in [0, size), or -1 when called from a thread
+// that does not belong to the pool.
+int thread_pool_worker_index(ThreadPool *pool);
+// Queues task(arg). Returns 0 if the task could not be queued.
+int thread_pool_submit(ThreadPool *pool, ThreadPoolTask task, void *arg);
+// Blocks until every submitted task, including tasks they spawned, finished.
+// Must not be called from a worker thread.
+void thread_pool_wait(ThreadPool *pool);
+void thread_pool_destroy(ThreadPool *pool);
+
+#endif // THREAD_POOL_H
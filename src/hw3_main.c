@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 // Helper function to compare images
 static int compare_images(Image *img1, Image *img2) {
@@ -21,7 +22,32 @@ static int compare_images(Image *img1, Image *img2) {
     return 1;
 }
 
+// Helper function to compare two files byte by byte
+static int compare_files(const char *filename1, const char *filename2) {
+    FILE *f1 = fopen(filename1, "rb");
+    FILE *f2 = fopen(filename2, "rb");
+    int same = f1 && f2;
+    
+    while (same) {
+        int c1 = fgetc(f1);
+        int c2 = fgetc(f2);
+        if (c1 != c2) same = 0;
+        if (c1 == EOF || c2 == EOF) break;
+    }
+    
+    if (f1) fclose(f1);
+    if (f2) fclose(f2);
+    return same;
+}
+
 // Test quadtree creation and basic properties
+// Asserts that two trees have the same preorder text.
+static void assert_same_tree(QTNode *expected, QTNode *root) {
+    save_preorder_qt(expected, "tests/output/same_expected.txt");
+    save_preorder_qt(root, "tests/output/same_tree.txt");
+    assert(compare_files("tests/output/same_expected.txt", "tests/output/same_tree.txt"));
+}
+
 void test_quadtree_creation() {
     printf("Testing quadtree creation...\n");
     
@@ -277,26 +303,17 @@ void test_hide_message_detailed() {
     
     printf("hide_message tests passed!\n");
 }
-static Image* create_test_image(unsigned short width, unsigned short height) {
-    Image *img = malloc(sizeof(Image));
+static Image* create_test_image(unsigned int width, unsigned int height) {
+    Image *img = create_image(width, height);
     if (!img) return NULL;
     
-    img->width = width;
-    img->height = height;
-    img->pixels = malloc(width * height * sizeof(unsigned char));
-    
-    if (!img->pixels) {
-        free(img);
-        return NULL;
-    }
-    
     // Create checkerboard pattern to force quadtree subdivisions
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
+    for (unsigned int i = 0; i < height; i++) {
+        for (unsigned int j = 0; j < width; j++) {
             if ((i/8 + j/8) % 2) {
-                img->pixels[i * width + j] = 255;
+                img->pixels[(size_t)i * width + j] = 255;
             } else {
-                img->pixels[i * width + j] = 0;
+                img->pixels[(size_t)i * width + j] = 0;
             }
         }
     }
@@ -351,7 +368,7 @@ void test_quadtree_moderate() {
             // Verify images match
             assert(img1->width == img2->width);
             assert(img1->height == img2->height);
-            for (int k = 0; k < img1->width * img1->height; k++) {
+            for (size_t k = 0; k < (size_t)img1->width * img1->height; k++) {
                 assert(img1->pixels[k] == img2->pixels[k]);
             }
             
@@ -428,6 +445,1324 @@ void test_steganography_moderate() {
     printf("Moderate steganography tests passed!\n");
 }
 
+void test_quadtree_parallel() {
+    printf("\nTesting parallel quadtree creation...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    assert(image != NULL);
+    
+    double rmse_values[] = {0.0, 5.0, 25.0};
+    unsigned int thread_counts[] = {1, 2, 4};
+    for (int i = 0; i < 3; i++) {
+        QTNode *serial = create_quadtree(image, rmse_values[i]);
+        assert(serial != NULL);
+        
+        for (int j = 0; j < 3; j++) {
+            printf("Testing RMSE %.1f with %u threads\n", rmse_values[i], thread_counts[j]);
+            QTNode *parallel = create_quadtree_parallel(image, rmse_values[i], thread_counts[j]);
+            assert(parallel != NULL);
+            
+            // The parallel build must produce exactly the serial tree
+            assert_same_tree(serial, parallel);
+            delete_quadtree(parallel);
+        }
+        
+        delete_quadtree(serial);
+    }
+    
+    assert(create_quadtree_parallel(NULL, 25.0, 4) == NULL);
+    assert(create_quadtree_parallel(image, -1.0, 4) == NULL);
+    
+    delete_image(image);
+    printf("Parallel quadtree tests passed!\n");
+}
+
+void test_delete_subtree() {
+    printf("\nTesting subtree deletion...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    QTNode *expected = create_quadtree(image, 10.0);
+    
+    // A subtree deleted before or after the rest of its tree
+    QTNode *roots[] = {create_quadtree(image, 10.0), create_quadtree_parallel(image, 10.0, 4)};
+    for (int i = 0; i < 2; i++) {
+        QTNode *subtree = roots[i]->child4;
+        roots[i]->child4 = NULL;
+        delete_quadtree(subtree);
+        
+        subtree = roots[i]->child1;
+        roots[i]->child1 = NULL;
+        delete_quadtree(roots[i]);
+        assert_same_tree(expected->child1, subtree);
+        delete_quadtree(subtree);
+    }
+    
+    // Hand-built trees, alone and mixed with built ones both ways
+    QTNode *root = create_qtree_node(128, 0, 0, 2, 2);
+    root->child1 = create_qtree_node(0, 0, 0, 1, 1);
+    root->child2 = create_qtree_node(64, 0, 1, 1, 1);
+    root->child3 = create_quadtree(image, 25.0);
+    QTNode *other = create_quadtree(image, 25.0);
+    root->child4 = other->child2;
+    other->child2 = NULL;
+    delete_quadtree(root->child2);
+    root->child2 = NULL;
+    delete_quadtree(root);
+    delete_quadtree(other);
+    
+    root = create_quadtree(image, 25.0);
+    QTNode *leaf = root;
+    while (leaf->child1) leaf = leaf->child1;
+    leaf->child1 = create_qtree_node(7, leaf->row, leaf->col, 1, 1);
+    delete_quadtree(root);
+    
+    delete_quadtree(expected);
+    delete_image(image);
+    printf("Subtree deletion tests passed!\n");
+}
+
+// Helper function to read the two-byte magic number of a Netpbm file
+static int read_magic(const char *filename, char magic[3]) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return 0;
+    int ok = fread(magic, 1, 2, fp) == 2;
+    magic[2] = '\0';
+    fclose(fp);
+    return ok;
+}
+
+void test_binary_formats() {
+    printf("\nTesting binary P5/P6 formats...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    assert(image != NULL);
+    
+    // Round trip the image through both binary formats
+    char magic[3];
+    assert(save_image(image, "tests/output/building1_p5.pgm", PNM_P5));
+    assert(save_image(image, "tests/output/building1_p6.ppm", PNM_P6));
+    assert(read_magic("tests/output/building1_p5.pgm", magic) && strcmp(magic, "P5") == 0);
+    assert(read_magic("tests/output/building1_p6.ppm", magic) && strcmp(magic, "P6") == 0);
+    
+    Image *p5 = load_image("tests/output/building1_p5.pgm");
+    Image *p6 = load_image("tests/output/building1_p6.ppm");
+    assert(compare_images(image, p5));
+    assert(compare_images(image, p6));
+    
+    // Quadtree reconstructions must match across formats
+    QTNode *root = create_quadtree(image, 25.0);
+    save_qtree_as_ppm(root, "tests/output/qtree_p3.ppm");
+    save_qtree_as_pnm(root, "tests/output/qtree_p5.pgm", PNM_P5);
+    Image *qt_p3 = load_image("tests/output/qtree_p3.ppm");
+    Image *qt_p5 = load_image("tests/output/qtree_p5.pgm");
+    assert(compare_images(qt_p3, qt_p5));
+    
+    // Steganography keeps the cover's format
+    unsigned int hidden = hide_message("Binary cover", "tests/output/building1_p5.pgm",
+                                       "tests/output/hidden_msg_p5.pgm");
+    assert(hidden == strlen("Binary cover"));
+    assert(read_magic("tests/output/hidden_msg_p5.pgm", magic) && strcmp(magic, "P5") == 0);
+    char *revealed = reveal_message("tests/output/hidden_msg_p5.pgm");
+    assert(revealed != NULL && strcmp(revealed, "Binary cover") == 0);
+    free(revealed);
+    
+    prepare_input_image_file("wolfie-tiny.ppm");
+    assert(hide_image("images/wolfie-tiny.ppm", "tests/output/building1_p6.ppm",
+                      "tests/output/hidden_img_p6.ppm") == 1);
+    assert(read_magic("tests/output/hidden_img_p6.ppm", magic) && strcmp(magic, "P6") == 0);
+    reveal_image("tests/output/hidden_img_p6.ppm", "tests/output/revealed_img_p6.ppm");
+    Image *secret = load_image("images/wolfie-tiny.ppm");
+    Image *secret_revealed = load_image("tests/output/revealed_img_p6.ppm");
+    assert(compare_images(secret, secret_revealed));
+    
+    // Truncated binary data is rejected
+    FILE *fp = fopen("tests/output/truncated.pgm", "wb");
+    fprintf(fp, "P5\n4 4\n255\n");
+    fwrite("\x01\x02\x03", 1, 3, fp);
+    fclose(fp);
+    assert(load_image("tests/output/truncated.pgm") == NULL);
+    
+    delete_image(secret);
+    delete_image(secret_revealed);
+    delete_image(qt_p3);
+    delete_image(qt_p5);
+    delete_quadtree(root);
+    delete_image(p5);
+    delete_image(p6);
+    delete_image(image);
+    printf("Binary format tests passed!\n");
+}
+
+void test_save_qtree_as_ppm_expected() {
+    printf("\nTesting save_qtree_as_ppm against expected output...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    QTNode *root = create_quadtree(image, 25);
+    assert(root != NULL);
+    
+    save_qtree_as_ppm(root, "tests/output/save_qtree_as_ppm1.ppm");
+    Image *expected = load_image("tests/expected/save_qtree_as_ppm1.ppm");
+    Image *actual = load_image("tests/output/save_qtree_as_ppm1.ppm");
+    assert(compare_images(expected, actual));
+    
+    // Every row ends with a newline after the last "v v v " triple
+    FILE *fp = fopen("tests/output/save_qtree_as_ppm1.ppm", "r");
+    char line[256 * 12 + 16];
+    assert(fgets(line, sizeof(line), fp) && strcmp(line, "P3\n") == 0);
+    assert(fgets(line, sizeof(line), fp) && strcmp(line, "256 256\n") == 0);
+    assert(fgets(line, sizeof(line), fp) && strcmp(line, "255\n") == 0);
+    int rows = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        size_t length = strlen(line);
+        assert(length >= 2 && line[length - 1] == '\n' && line[length - 2] == ' ');
+        rows++;
+    }
+    assert(rows == 256);
+    fclose(fp);
+    
+    delete_image(expected);
+    delete_image(actual);
+    delete_quadtree(root);
+    delete_image(image);
+    printf("save_qtree_as_ppm expected output tests passed!\n");
+}
+
+// Helper function to get the size of a file in bytes
+static long file_size(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 ? (long)st.st_size : -1;
+}
+
+void test_binary_preorder() {
+    printf("\nTesting binary preorder format...\n");
+    
+    // The reference tree round trips through the binary format unchanged
+    QTNode *root = load_preorder_qt("tests/input/load_preorder_qt1_qtree.txt");
+    assert(root != NULL);
+    assert(save_preorder_qt_binary(root, "tests/output/load_preorder_qt1_qtree.qtb"));
+    QTNode *loaded = load_preorder_qt_binary("tests/output/load_preorder_qt1_qtree.qtb");
+    assert(loaded != NULL);
+    save_preorder_qt(loaded, "tests/output/binary_round_trip.txt");
+    assert(compare_files("tests/input/load_preorder_qt1_qtree.txt",
+                         "tests/output/binary_round_trip.txt"));
+    
+    long text_size = file_size("tests/input/load_preorder_qt1_qtree.txt");
+    long binary_size = file_size("tests/output/load_preorder_qt1_qtree.qtb");
+    printf("Text: %ld bytes, binary: %ld bytes\n", text_size, binary_size);
+    assert(binary_size > 0 && binary_size * 10 < text_size);
+    delete_quadtree(loaded);
+    delete_quadtree(root);
+    
+    // Odd sizes exercise the single row/column splits
+    unsigned short sizes[][2] = {{1, 1}, {1, 7}, {7, 1}, {13, 5}, {64, 64}};
+    for (int i = 0; i < 5; i++) {
+        Image *image = create_test_image(sizes[i][0], sizes[i][1]);
+        for (unsigned int k = 0; k < (unsigned int)sizes[i][0] * sizes[i][1]; k++) {
+            image->pixels[k] = (unsigned char)(k * 37);
+        }
+        root = create_quadtree(image, 0.0);
+        assert(save_preorder_qt_binary(root, "tests/output/binary_tree.qtb"));
+        loaded = load_preorder_qt_binary("tests/output/binary_tree.qtb");
+        assert(loaded != NULL);
+        assert_same_tree(root, loaded);
+        delete_quadtree(loaded);
+        delete_quadtree(root);
+        delete_image(image);
+    }
+    
+    // Truncated and foreign files are rejected
+    FILE *fp = fopen("tests/output/truncated.qtb", "wb");
+    fwrite("QTB1\x04\0\0\0\x04\0\0\0\x01\x10", 1, 14, fp);
+    fclose(fp);
+    assert(load_preorder_qt_binary("tests/output/truncated.qtb") == NULL);
+    assert(load_preorder_qt_binary("tests/input/load_preorder_qt1_qtree.txt") == NULL);
+    
+    printf("Binary preorder tests passed!\n");
+}
+
+void test_compressed_preorder() {
+    printf("\nTesting entropy-coded preorder format...\n");
+    
+    QTNode *root = load_preorder_qt("tests/input/load_preorder_qt1_qtree.txt");
+    assert(root != NULL);
+    assert(save_preorder_qt_compressed(root, "tests/output/load_preorder_qt1_qtree.qte"));
+    assert(save_preorder_qt_binary(root, "tests/output/load_preorder_qt1_qtree.qtb"));
+    
+    QTNode *loaded = load_preorder_qt_compressed("tests/output/load_preorder_qt1_qtree.qte");
+    assert(loaded != NULL);
+    save_preorder_qt(loaded, "tests/output/compressed_round_trip.txt");
+    assert(compare_files("tests/input/load_preorder_qt1_qtree.txt",
+                         "tests/output/compressed_round_trip.txt"));
+    
+    long binary_size = file_size("tests/output/load_preorder_qt1_qtree.qtb");
+    long coded_size = file_size("tests/output/load_preorder_qt1_qtree.qte");
+    printf("Binary: %ld bytes, entropy-coded: %ld bytes\n", binary_size, coded_size);
+    assert(coded_size > 0 && coded_size < binary_size);
+    delete_quadtree(loaded);
+    delete_quadtree(root);
+    
+    // Deep trees and single rows/columns
+    prepare_input_image_file("wolfie-tiny.ppm");
+    Image *image = load_image("images/wolfie-tiny.ppm");
+    double rmse_values[] = {0.0, 10.0, 255.0};
+    for (int i = 0; i < 3; i++) {
+        root = create_quadtree(image, rmse_values[i]);
+        assert(save_preorder_qt_compressed(root, "tests/output/compressed_tree.qte"));
+        loaded = load_preorder_qt_compressed("tests/output/compressed_tree.qte");
+        assert(loaded != NULL);
+        assert_same_tree(root, loaded);
+        delete_quadtree(loaded);
+        delete_quadtree(root);
+    }
+    delete_image(image);
+    
+    // Truncated streams are rejected
+    FILE *fp = fopen("tests/output/truncated.qte", "wb");
+    fwrite("QTE1\x00\x01\0\0\x00\x01\0\0\x00\x5a", 1, 14, fp);
+    fclose(fp);
+    assert(load_preorder_qt_compressed("tests/output/truncated.qte") == NULL);
+    assert(load_preorder_qt_compressed("tests/output/load_preorder_qt1_qtree.qtb") == NULL);
+    
+    printf("Entropy-coded preorder tests passed!\n");
+}
+
+void test_render_preorder() {
+    printf("\nTesting rendering straight from preorder files...\n");
+    
+    // Text and binary files render to the same image as load + save
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    double rmse_values[] = {0.0, 25.0, 255.0};
+    for (int i = 0; i < 3; i++) {
+        QTNode *root = create_quadtree(image, rmse_values[i]);
+        save_preorder_qt(root, "tests/output/render_tree.txt");
+        assert(save_preorder_qt_binary(root, "tests/output/render_tree.qtb"));
+        save_qtree_as_pnm(root, "tests/output/render_expected.pgm", PNM_P5);
+        delete_quadtree(root);
+        
+        assert(render_preorder_qt("tests/output/render_tree.txt",
+                                  "tests/output/render_text.pgm", PNM_P5));
+        assert(compare_files("tests/output/render_expected.pgm", "tests/output/render_text.pgm"));
+        assert(render_preorder_qt("tests/output/render_tree.qtb",
+                                  "tests/output/render_binary.pgm", PNM_P5));
+        assert(compare_files("tests/output/render_expected.pgm", "tests/output/render_binary.pgm"));
+    }
+    delete_image(image);
+    
+    // The reference tree, with the single row/column quirks of the text format
+    QTNode *root = load_preorder_qt("tests/input/load_preorder_qt1_qtree.txt");
+    assert(root != NULL);
+    save_qtree_as_ppm(root, "tests/output/render_expected.ppm");
+    delete_quadtree(root);
+    assert(render_preorder_qt("tests/input/load_preorder_qt1_qtree.txt",
+                              "tests/output/render_text.ppm", PNM_P3));
+    assert(compare_files("tests/output/render_expected.ppm", "tests/output/render_text.ppm"));
+    
+    // Leaves outside the root, truncated files and missing files are rejected
+    FILE *fp = fopen("tests/output/render_bad.txt", "w");
+    fprintf(fp, "N 10 0 2 0 2\nL 1 0 1 0 1\nL 2 0 1 1 1\nL 3 1 1 0 1\nL 4 1 1 2 1\n");
+    fclose(fp);
+    assert(!render_preorder_qt("tests/output/render_bad.txt", "tests/output/render_bad.pgm", PNM_P5));
+    fp = fopen("tests/output/render_bad.txt", "w");
+    fprintf(fp, "N 10 0 2 0 2\nL 1 0 1 0 1\n");
+    fclose(fp);
+    assert(!render_preorder_qt("tests/output/render_bad.txt", "tests/output/render_bad.pgm", PNM_P5));
+    assert(!render_preorder_qt("tests/output/truncated.qtb", "tests/output/render_bad.pgm", PNM_P5));
+    assert(!render_preorder_qt("tests/output/missing.qtb", "tests/output/render_bad.pgm", PNM_P5));
+    
+    printf("Preorder rendering tests passed!\n");
+}
+
+void test_encode_preorder() {
+    printf("\nTesting streaming preorder encoding...\n");
+    
+    // Byte-identical to building the tree and saving it
+    prepare_input_image_file("building1.ppm");
+    Image *images[2] = {load_image("images/building1.ppm"), create_test_image(13, 5)};
+    double rmse_values[] = {0.0, 10.0, 25.0, 255.0};
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 4; j++) {
+            QTNode *root = create_quadtree(images[i], rmse_values[j]);
+            save_preorder_qt(root, "tests/output/encode_expected.txt");
+            assert(save_preorder_qt_binary(root, "tests/output/encode_expected.qtb"));
+            delete_quadtree(root);
+            
+            assert(encode_preorder_qt(images[i], rmse_values[j], "tests/output/encode_text.txt"));
+            assert(compare_files("tests/output/encode_expected.txt", "tests/output/encode_text.txt"));
+            assert(encode_preorder_qt_binary(images[i], rmse_values[j],
+                                             "tests/output/encode_binary.qtb"));
+            assert(compare_files("tests/output/encode_expected.qtb", "tests/output/encode_binary.qtb"));
+        }
+        delete_image(images[i]);
+    }
+    
+    assert(!encode_preorder_qt(NULL, 10.0, "tests/output/encode_text.txt"));
+    assert(!encode_preorder_qt_binary(NULL, 10.0, "tests/output/encode_binary.qtb"));
+    
+    printf("Streaming preorder encoding tests passed!\n");
+}
+
+static int compare_linear_subtree(QTLinearTree *tree, QTLinearNode linear, QTNode *node) {
+    if (!node) return linear.index == QT_LINEAR_NONE;
+    if (linear.index == QT_LINEAR_NONE) return 0;
+    if (get_linear_intensity(tree, linear) != get_node_intensity(node) ||
+        linear.row != node->row || linear.col != node->col ||
+        linear.height != node->height || linear.width != node->width) {
+        return 0;
+    }
+    return compare_linear_subtree(tree, get_linear_child1(tree, linear), get_child1(node)) &&
+           compare_linear_subtree(tree, get_linear_child2(tree, linear), get_child2(node)) &&
+           compare_linear_subtree(tree, get_linear_child3(tree, linear), get_child3(node)) &&
+           compare_linear_subtree(tree, get_linear_child4(tree, linear), get_child4(node));
+}
+
+void test_linear_quadtree() {
+    printf("\nTesting linear quadtree...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *images[2] = {load_image("images/building1.ppm"), create_test_image(13, 5)};
+    double rmse_values[] = {0.0, 10.0, 25.0, 255.0};
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 4; j++) {
+            QTNode *root = create_quadtree(images[i], rmse_values[j]);
+            QTLinearTree *linear = linear_from_quadtree(root);
+            assert(linear != NULL);
+            assert(compare_linear_subtree(linear, get_linear_root(linear), root));
+            
+            // Built directly, the arrays are the same
+            QTLinearTree *built = create_linear_quadtree(images[i], rmse_values[j]);
+            assert(built != NULL && built->count == linear->count);
+            assert(memcmp(built->intensity, linear->intensity, linear->count) == 0);
+            assert(memcmp(built->subtree, linear->subtree, linear->count * sizeof(uint32_t)) == 0);
+            
+            // Back to pointers, and rendered by a linear scan
+            QTNode *converted = quadtree_from_linear(linear);
+            assert_same_tree(root, converted);
+            save_qtree_as_pnm(root, "tests/output/linear_expected.pgm", PNM_P5);
+            assert(save_linear_qtree_as_pnm(linear, "tests/output/linear.pgm", PNM_P5));
+            assert(compare_files("tests/output/linear_expected.pgm", "tests/output/linear.pgm"));
+            
+            delete_quadtree(converted);
+            delete_linear_quadtree(built);
+            delete_linear_quadtree(linear);
+            delete_quadtree(root);
+        }
+        delete_image(images[i]);
+    }
+    
+    // The reference tree converts; one with a misplaced child does not
+    QTNode *root = load_preorder_qt("tests/input/load_preorder_qt1_qtree.txt");
+    assert(root != NULL);
+    QTLinearTree *linear = linear_from_quadtree(root);
+    assert(linear != NULL);
+    assert(compare_linear_subtree(linear, get_linear_root(linear), root));
+    delete_linear_quadtree(linear);
+    root->child1->col++;
+    assert(linear_from_quadtree(root) == NULL);
+    delete_quadtree(root);
+    assert(linear_from_quadtree(NULL) == NULL);
+    assert(get_linear_root(NULL).index == QT_LINEAR_NONE);
+    
+    printf("Linear quadtree tests passed!\n");
+}
+
+// Images the tree builders are checked against each other on. eagle.ppm has
+// nodes whose RMSE is exactly 0.5, the tie case where summed-area RMSEs fall
+// back to an exact scan of the pixels.
+static const char *test_images[] = {"building1.ppm", "eagle.ppm"};
+#define TEST_IMAGE_COUNT 2
+
+static Image *load_test_image(const char *name) {
+    char path[64];
+    prepare_input_image_file((char *)name);
+    snprintf(path, sizeof(path), "images/%s", name);
+    return load_image(path);
+}
+
+void test_multi_quadtree() {
+    printf("\nTesting multi-threshold quadtree...\n");
+    
+    double rmse_values[] = {0.0, 0.5, 5.0, 10.0, 25.0, 50.0, 255.0};
+    for (int i = 0; i < TEST_IMAGE_COUNT; i++) {
+        Image *image = load_test_image(test_images[i]);
+        QTMultiTree *multi = create_multi_quadtree(image);
+        assert(multi != NULL);
+        
+        for (int j = 0; j < 7; j++) {
+            QTNode *expected = create_quadtree(image, rmse_values[j]);
+            save_qtree_as_pnm(expected, "tests/output/multi_expected.pgm", PNM_P5);
+            
+            QTNode *root = extract_quadtree(multi, rmse_values[j]);
+            assert(root != NULL);
+            assert_same_tree(expected, root);
+            delete_quadtree(root);
+            delete_quadtree(expected);
+            
+            assert(save_multi_qtree_as_pnm(multi, rmse_values[j], "tests/output/multi.pgm", PNM_P5));
+            assert(compare_files("tests/output/multi_expected.pgm", "tests/output/multi.pgm"));
+        }
+        
+        delete_multi_quadtree(multi);
+        delete_image(image);
+    }
+    
+    assert(create_multi_quadtree(NULL) == NULL);
+    assert(extract_quadtree(NULL, 10.0) == NULL);
+    
+    printf("Multi-threshold quadtree tests passed!\n");
+}
+
+static size_t count_nodes(QTNode *node) {
+    if (!node) return 0;
+    return 1 + count_nodes(get_child1(node)) + count_nodes(get_child2(node)) +
+           count_nodes(get_child3(node)) + count_nodes(get_child4(node));
+}
+
+// Sum of squared differences between image and the rendering of root
+static double tree_squared_error(QTNode *root, Image *image) {
+    save_qtree_as_pnm(root, "tests/output/squared_error.pgm", PNM_P5);
+    Image *rendered = load_image("tests/output/squared_error.pgm");
+    assert(rendered != NULL);
+    
+    double error = 0.0;
+    for (size_t i = 0; i < (size_t)image->width * image->height; i++) {
+        double diff = (double)image->pixels[i] - rendered->pixels[i];
+        error += diff * diff;
+    }
+    delete_image(rendered);
+    return error;
+}
+
+void test_quadtree_budget() {
+    printf("\nTesting node-budget quadtree...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    
+    // More budget never hurts, and the budget is used up to the last split
+    size_t budgets[] = {1, 2, 100, 1000, 5000};
+    double previous_error = -1.0;
+    for (int i = 0; i < 5; i++) {
+        QTNode *root = create_quadtree_budget(image, budgets[i]);
+        assert(root != NULL);
+        size_t nodes = count_nodes(root);
+        assert(nodes <= budgets[i] && nodes + 4 > budgets[i]);
+        
+        double error = tree_squared_error(root, image);
+        assert(previous_error < 0 || error <= previous_error);
+        previous_error = error;
+        delete_quadtree(root);
+    }
+    
+    // At the same size it is at least as good as a threshold tree
+    QTNode *threshold_tree = create_quadtree(image, 25.0);
+    size_t threshold_nodes = count_nodes(threshold_tree);
+    QTNode *budget_tree = create_quadtree_budget(image, threshold_nodes);
+    printf("%zu nodes: squared error %.0f by threshold, %.0f by budget\n", threshold_nodes,
+           tree_squared_error(threshold_tree, image), tree_squared_error(budget_tree, image));
+    assert(tree_squared_error(budget_tree, image) <= tree_squared_error(threshold_tree, image));
+    delete_quadtree(budget_tree);
+    delete_quadtree(threshold_tree);
+    
+    // An unlimited budget gives the lossless tree
+    QTNode *expected = create_quadtree(image, 0.0);
+    QTNode *root = create_quadtree_budget(image, (size_t)-1);
+    assert_same_tree(expected, root);
+    delete_quadtree(root);
+    delete_quadtree(expected);
+    delete_image(image);
+    
+    assert(create_quadtree_budget(NULL, 100) == NULL);
+    
+    printf("Node-budget quadtree tests passed!\n");
+}
+
+void test_qtree_queries() {
+    printf("\nTesting point and region queries...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    QTNode *trees[2] = {create_quadtree(image, 25.0),
+                        load_preorder_qt("tests/input/load_preorder_qt1_qtree.txt")};
+    delete_image(image);
+    
+    for (int t = 0; t < 2; t++) {
+        QTNode *root = trees[t];
+        assert(root != NULL);
+        save_qtree_as_pnm(root, "tests/output/queries_full.pgm", PNM_P5);
+        Image *full = load_image("tests/output/queries_full.pgm");
+        unsigned int width = full->width, height = full->height;
+        size_t npixels = (size_t)width * height;
+        
+        // Every pixel, singly and batched in scanline and scattered order
+        unsigned int *rows = malloc(npixels * sizeof(unsigned int));
+        unsigned int *cols = malloc(npixels * sizeof(unsigned int));
+        unsigned char *samples = malloc(npixels);
+        for (size_t i = 0; i < npixels; i++) {
+            assert(qtree_sample(root, (unsigned int)(i / width), (unsigned int)(i % width)) ==
+                   full->pixels[i]);
+            rows[i] = (unsigned int)(i / width);
+            cols[i] = (unsigned int)(i % width);
+        }
+        qtree_sample_batch(root, rows, cols, npixels, samples);
+        assert(memcmp(samples, full->pixels, npixels) == 0);
+        for (size_t i = 0; i < npixels; i++) {
+            size_t k = (i * 7919) % npixels;
+            rows[i] = (unsigned int)(k / width);
+            cols[i] = (unsigned int)(k % width);
+        }
+        qtree_sample_batch(root, rows, cols, npixels, samples);
+        for (size_t i = 0; i < npixels; i++) {
+            assert(samples[i] == full->pixels[(size_t)rows[i] * width + cols[i]]);
+        }
+        assert(qtree_sample(root, height, 0) == 0 && qtree_sample(root, 0, width) == 0);
+        
+        // Windows inside, across the edge of and outside the image
+        unsigned int windows[][4] = {{0, 0, height, width}, {3, 5, 17, 11},
+                                     {height - 9, width - 4, 20, 30}, {height, width, 2, 2},
+                                     {0, 0, 1, 1}};
+        for (int w = 0; w < 5; w++) {
+            unsigned int r0 = windows[w][0], c0 = windows[w][1];
+            unsigned int h = windows[w][2], wd = windows[w][3];
+            unsigned char *buf = malloc((size_t)h * wd);
+            assert(qtree_render_region(root, r0, c0, h, wd, buf));
+            for (unsigned int i = 0; i < h; i++) {
+                for (unsigned int j = 0; j < wd; j++) {
+                    unsigned char expected = (r0 + i < height && c0 + j < width)
+                        ? full->pixels[(size_t)(r0 + i) * width + c0 + j] : 0;
+                    assert(buf[(size_t)i * wd + j] == expected);
+                }
+            }
+            free(buf);
+        }
+        
+        free(samples);
+        free(cols);
+        free(rows);
+        delete_image(full);
+        delete_quadtree(root);
+    }
+    
+    assert(qtree_sample(NULL, 0, 0) == 0);
+    assert(!qtree_render_region(NULL, 0, 0, 1, 1, NULL));
+    
+    printf("Point and region query tests passed!\n");
+}
+
+void test_qtree_lod() {
+    printf("\nTesting level-of-detail rendering...\n");
+    
+    // At the source size and full depth it is save_qtree_as_pnm
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    QTNode *root = create_quadtree(image, 10.0);
+    save_qtree_as_pnm(root, "tests/output/lod_expected.pgm", PNM_P5);
+    assert(save_qtree_as_pnm_lod(root, "tests/output/lod_full.pgm", PNM_P5, QT_FULL_DEPTH,
+                                 image->width, image->height));
+    assert(compare_files("tests/output/lod_expected.pgm", "tests/output/lod_full.pgm"));
+    
+    // Depth 0 is the root's intensity everywhere
+    size_t npixels = (size_t)image->width * image->height;
+    unsigned char *pixels = malloc(npixels);
+    assert(qtree_render_lod(root, 0, image->width, image->height, pixels));
+    for (size_t i = 0; i < npixels; i++) assert(pixels[i] == get_node_intensity(root));
+    
+    // Thumbnails of odd sizes come out with the requested dimensions
+    assert(save_qtree_as_pnm_lod(root, "tests/output/lod_thumb.pgm", PNM_P5, QT_FULL_DEPTH, 37, 23));
+    Image *thumb = load_image("tests/output/lod_thumb.pgm");
+    assert(thumb != NULL && thumb->width == 37 && thumb->height == 23);
+    delete_image(thumb);
+    delete_quadtree(root);
+    delete_image(image);
+    
+    // Halving a lossless tree of a 64x64 image averages each 2x2 block, as
+    // does stopping one level above the leaves
+    image = create_test_image(64, 64);
+    for (unsigned int i = 0; i < 64 * 64; i++) image->pixels[i] = (unsigned char)(i * 37 + i / 64);
+    root = create_quadtree(image, 0.0);
+    assert(qtree_render_lod(root, QT_FULL_DEPTH, 32, 32, pixels));
+    for (unsigned int i = 0; i < 32; i++) {
+        for (unsigned int j = 0; j < 32; j++) {
+            unsigned int sum = 0;
+            for (unsigned int k = 0; k < 4; k++) {
+                sum += image->pixels[(2 * i + k / 2) * 64 + 2 * j + k % 2];
+            }
+            assert(pixels[i * 32 + j] == sum / 4);
+        }
+    }
+    unsigned char *full = malloc(64 * 64);
+    assert(qtree_render_lod(root, 5, 64, 64, full));
+    for (unsigned int i = 0; i < 64 * 64; i++) {
+        assert(full[i] == pixels[(i / 64 / 2) * 32 + (i % 64) / 2]);
+    }
+    free(full);
+    free(pixels);
+    delete_quadtree(root);
+    delete_image(image);
+    
+    assert(!qtree_render_lod(NULL, QT_FULL_DEPTH, 1, 1, NULL));
+    
+    printf("Level-of-detail rendering tests passed!\n");
+}
+
+void test_qtree_render() {
+    printf("\nTesting rendering into caller buffers...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    QTNode *root = create_quadtree(image, 10.0);
+    save_qtree_as_pnm(root, "tests/output/render_buffer_expected.pgm", PNM_P5);
+    Image *expected = load_image("tests/output/render_buffer_expected.pgm");
+    
+    // Rows padded to a wider stride; the padding is left alone
+    size_t stride = (size_t)image->width + 13;
+    unsigned char *frame = malloc(stride * image->height);
+    memset(frame, 0xAB, stride * image->height);
+    assert(qtree_render(root, frame, stride));
+    for (unsigned int i = 0; i < image->height; i++) {
+        assert(memcmp(frame + i * stride, expected->pixels + (size_t)i * image->width,
+                      image->width) == 0);
+        for (size_t j = image->width; j < stride; j++) assert(frame[i * stride + j] == 0xAB);
+    }
+    
+    assert(!qtree_render(root, frame, image->width - 1));
+    assert(!qtree_render(NULL, frame, stride));
+    
+    free(frame);
+    delete_image(expected);
+    delete_quadtree(root);
+    delete_image(image);
+    
+    printf("Caller buffer rendering tests passed!\n");
+}
+
+void test_qtree_render_parallel() {
+    printf("\nTesting parallel rendering and formatting...\n");
+    
+    prepare_input_image_file("building1.ppm");
+    Image *images[3] = {load_image("images/building1.ppm"), create_test_image(1, 300),
+                        create_test_image(300, 1)};
+    PNMFormat formats[] = {PNM_P3, PNM_P5, PNM_P6};
+    unsigned int threads[] = {0, 2, 5};
+    for (int i = 0; i < 3; i++) {
+        QTNode *root = create_quadtree(images[i], 10.0);
+        size_t npixels = (size_t)images[i]->width * images[i]->height;
+        unsigned char *serial = calloc(npixels, 1);
+        unsigned char *parallel = calloc(npixels, 1);
+        assert(qtree_render(root, serial, images[i]->width));
+        
+        for (int t = 0; t < 3; t++) {
+            memset(parallel, 0, npixels);
+            assert(qtree_render_parallel(root, parallel, images[i]->width, threads[t]));
+            assert(memcmp(serial, parallel, npixels) == 0);
+            
+            for (int f = 0; f < 3; f++) {
+                save_qtree_as_pnm(root, "tests/output/parallel_render_expected.ppm", formats[f]);
+                assert(save_qtree_as_pnm_parallel(root, "tests/output/parallel_render.ppm",
+                                                  formats[f], threads[t]));
+                assert(compare_files("tests/output/parallel_render_expected.ppm",
+                                     "tests/output/parallel_render.ppm"));
+            }
+        }
+        
+        free(parallel);
+        free(serial);
+        delete_quadtree(root);
+        delete_image(images[i]);
+    }
+    
+    printf("Parallel rendering and formatting tests passed!\n");
+}
+
+// Writes a width x height P3 file whose samples are pixel i's value i % 251.
+// At sample number bad_index, if any, bad_token is written instead.
+static void write_p3_test_file(const char *filename, unsigned int width, unsigned int height,
+                               long bad_index, const char *bad_token, const char *trailer) {
+    FILE *fp = fopen(filename, "w");
+    assert(fp != NULL);
+    fprintf(fp, "P3\n%u %u\n255\n", width, height);
+    for (long k = 0; k < (long)width * height * 3; k++) {
+        if (k == bad_index) {
+            fprintf(fp, "%s ", bad_token);
+        } else {
+            fprintf(fp, "%ld%c", (k / 3) % 251, k % 12 == 11 ? '\n' : ' ');
+        }
+    }
+    fputs(trailer, fp);
+    fclose(fp);
+}
+
+void test_load_image_parallel() {
+    printf("\nTesting parallel P3 loading...\n");
+    
+    // Large enough to be split into chunks
+    const char *filename = "tests/output/parallel_load.ppm";
+    unsigned int width = 1100, height = 1000;
+    long middle = (long)width * height * 3 / 2;
+    struct {
+        long bad_index;
+        const char *bad_token;
+        const char *trailer;
+        int valid;
+    } cases[] = {
+        {-1, "", "", 1},
+        {-1, "", "junk after the last sample", 1},
+        {middle, "+7", "", 1},          // Signed samples are accepted
+        {middle, "1+2", "0", 1},        // Two samples in one run
+        {middle, "256", "", 0},
+        {middle, "12a", "", 0},
+        {middle, "-1", "", 0},
+        {(long)width * height * 3 - 1, "", "", 0},     // One sample short
+    };
+    
+    for (int c = 0; c < 8; c++) {
+        write_p3_test_file(filename, width, height, cases[c].bad_index, cases[c].bad_token,
+                           cases[c].trailer);
+        Image *expected = load_image((char *)filename);
+        assert((expected != NULL) == cases[c].valid);
+        
+        unsigned int threads[] = {0, 2, 3};
+        for (int t = 0; t < 3; t++) {
+            Image *image = load_image_parallel((char *)filename, threads[t]);
+            if (!expected) {
+                assert(image == NULL);
+                continue;
+            }
+            assert(image != NULL && compare_images(expected, image));
+            delete_image(image);
+        }
+        delete_image(expected);
+    }
+    
+    // Small and binary files take the serial paths
+    prepare_input_image_file("building1.ppm");
+    Image *expected = load_image("images/building1.ppm");
+    Image *image = load_image_parallel("images/building1.ppm", 0);
+    assert(image != NULL && compare_images(expected, image));
+    delete_image(image);
+    delete_image(expected);
+    
+    printf("Parallel P3 loading tests passed!\n");
+}
+
+void test_quadtree_tiled() {
+    printf("\nTesting tiled quadtree construction...\n");
+    
+    double rmse_values[] = {0.0, 0.5, 10.0, 25.0};
+    size_t tile_sizes[] = {1, 64 * 64, 1000, 0};
+    for (int i = 0; i < TEST_IMAGE_COUNT; i++) {
+        Image *image = load_test_image(test_images[i]);
+        save_image(image, "tests/output/tiled.pgm", PNM_P5);
+        save_image(image, "tests/output/tiled.ppm", PNM_P6);
+        
+        for (int j = 0; j < 4; j++) {
+            QTNode *expected = create_quadtree(image, rmse_values[j]);
+            for (int k = 0; k < 4; k++) {
+                const char *file = k % 2 ? "tests/output/tiled.ppm" : "tests/output/tiled.pgm";
+                QTNode *root = create_quadtree_tiled((char *)file, rmse_values[j], tile_sizes[k]);
+                assert(root != NULL);
+                assert_same_tree(expected, root);
+                delete_quadtree(root);
+            }
+            delete_quadtree(expected);
+        }
+        delete_image(image);
+    }
+    
+    // Wider than the old 4096 pixel limit
+    Image *wide = create_test_image(5000, 3);
+    assert(save_image(wide, "tests/output/wide.pgm", PNM_P5));
+    Image *loaded = load_image("tests/output/wide.pgm");
+    assert(loaded != NULL && get_image_width(loaded) == 5000);
+    assert(compare_images(wide, loaded));
+    QTNode *expected = create_quadtree(wide, 10.0);
+    QTNode *root = create_quadtree_tiled("tests/output/wide.pgm", 10.0, 256);
+    assert_same_tree(expected, root);
+    delete_quadtree(expected);
+    delete_quadtree(root);
+    delete_image(loaded);
+    delete_image(wide);
+    
+    // Text files cannot be mapped
+    assert(create_quadtree_tiled("images/building1.ppm", 10.0, 0) == NULL);
+    assert(create_quadtree_tiled("nonexistent.pgm", 10.0, 0) == NULL);
+    
+    printf("Tiled quadtree tests passed!\n");
+}
+
+void test_image_layout() {
+    printf("\nTesting tiled image layout...\n");
+    
+    double rmse_values[] = {0.0, 0.5, 10.0, 25.0};
+    for (int i = 0; i < TEST_IMAGE_COUNT; i++) {
+        Image *image = load_test_image(test_images[i]);
+        Image *tiled = load_test_image(test_images[i]);
+        assert(set_image_layout(tiled, IMAGE_TILED));
+        assert(tiled->layout == IMAGE_TILED);
+        
+        unsigned int width = get_image_width(image);
+        unsigned char *row = malloc(width);
+        for (unsigned int r = 0; r < get_image_height(image); r++) {
+            get_image_row(tiled, r, row);
+            for (unsigned int c = 0; c < width; c++) {
+                assert(get_image_intensity(tiled, r, c) == get_image_intensity(image, r, c));
+                assert(row[c] == get_image_intensity(image, r, c));
+            }
+        }
+        free(row);
+        
+        for (int j = 0; j < 4; j++) {
+            QTNode *expected = create_quadtree(image, rmse_values[j]);
+            QTNode *root = create_quadtree(tiled, rmse_values[j]);
+            assert_same_tree(expected, root);
+            delete_quadtree(root);
+            
+            root = create_quadtree_parallel(tiled, rmse_values[j], 4);
+            assert_same_tree(expected, root);
+            delete_quadtree(root);
+            delete_quadtree(expected);
+        }
+        
+        QTMultiTree *multi = create_multi_quadtree(tiled);
+        assert(multi != NULL);
+        QTNode *expected = create_quadtree(image, 0.5);
+        QTNode *root = extract_quadtree(multi, 0.5);
+        assert_same_tree(expected, root);
+        delete_quadtree(expected);
+        delete_quadtree(root);
+        delete_multi_quadtree(multi);
+        
+        save_image(image, "tests/output/layout_expected.pgm", PNM_P5);
+        save_image(tiled, "tests/output/layout.pgm", PNM_P5);
+        assert(compare_files("tests/output/layout_expected.pgm", "tests/output/layout.pgm"));
+        
+        assert(set_image_layout(tiled, IMAGE_ROW_MAJOR));
+        assert(compare_images(image, tiled));
+        delete_image(tiled);
+        delete_image(image);
+    }
+    
+    // Edges that are not whole blocks
+    Image *image = create_test_image(13, 5);
+    Image *tiled = create_test_image(13, 5);
+    assert(set_image_layout(tiled, IMAGE_TILED));
+    for (unsigned int r = 0; r < 5; r++) {
+        for (unsigned int c = 0; c < 13; c++) {
+            assert(get_image_intensity(tiled, r, c) == get_image_intensity(image, r, c));
+        }
+    }
+    assert(set_image_layout(tiled, IMAGE_ROW_MAJOR));
+    assert(compare_images(image, tiled));
+    delete_image(tiled);
+    delete_image(image);
+    
+    // create_image always starts row-major
+    image = create_image(13, 5);
+    assert(image != NULL && image->layout == IMAGE_ROW_MAJOR);
+    assert(get_image_width(image) == 13 && get_image_height(image) == 5);
+    delete_image(image);
+    assert(create_image(0, 5) == NULL);
+    assert(create_image(13, 0) == NULL);
+    
+    printf("Tiled image layout tests passed!\n");
+}
+
+void test_quadtree_bottom_up() {
+    printf("\nTesting bottom-up quadtree construction...\n");
+    
+    double rmse_values[] = {0.0, 0.5, 10.0, 25.0, 255.0};
+    for (int i = 0; i < TEST_IMAGE_COUNT; i++) {
+        Image *image = load_test_image(test_images[i]);
+        for (int j = 0; j < 5; j++) {
+            QTNode *expected = create_quadtree(image, rmse_values[j]);
+            QTNode *root = create_quadtree_bottom_up(image, rmse_values[j]);
+            assert(root != NULL);
+            assert_same_tree(expected, root);
+            delete_quadtree(root);
+            delete_quadtree(expected);
+        }
+        delete_image(image);
+    }
+    
+    // Odd sizes, where the second halves take the remainders
+    unsigned int sizes[][2] = {{1, 1}, {1, 7}, {7, 1}, {13, 5}, {37, 61}};
+    for (int i = 0; i < 5; i++) {
+        Image *image = create_test_image(sizes[i][0], sizes[i][1]);
+        for (unsigned int k = 0; k < sizes[i][0] * sizes[i][1]; k++) {
+            image->pixels[k] = (unsigned char)(image->pixels[k] ^ (k * 37 % 64));
+        }
+        for (int j = 0; j < 5; j++) {
+            QTNode *expected = create_quadtree(image, rmse_values[j]);
+            QTNode *root = create_quadtree_bottom_up(image, rmse_values[j]);
+            assert_same_tree(expected, root);
+            delete_quadtree(root);
+            delete_quadtree(expected);
+        }
+        delete_image(image);
+    }
+    
+    assert(create_quadtree_bottom_up(NULL, 10.0) == NULL);
+    
+    printf("Bottom-up quadtree tests passed!\n");
+}
+
+static void check_dag_round_trip(QTNode *root) {
+    QTDag *dag = dag_from_quadtree(root);
+    assert(dag != NULL);
+    QTNode *expanded = quadtree_from_dag(dag);
+    assert_same_tree(root, expanded);
+    delete_quadtree(expanded);
+    
+    save_qtree_as_pnm(root, "tests/output/dag_expected.pgm", PNM_P5);
+    assert(save_dag_qtree_as_pnm(dag, "tests/output/dag.pgm", PNM_P5));
+    assert(compare_files("tests/output/dag_expected.pgm", "tests/output/dag.pgm"));
+    
+    assert(save_dag_qtree(dag, "tests/output/dag.qtd"));
+    QTDag *loaded = load_dag_qtree("tests/output/dag.qtd");
+    assert(loaded != NULL && loaded->count == dag->count);
+    expanded = quadtree_from_dag(loaded);
+    assert_same_tree(root, expanded);
+    delete_quadtree(expanded);
+    delete_dag_quadtree(loaded);
+    delete_dag_quadtree(dag);
+}
+
+void test_dag_quadtree() {
+    printf("\nTesting deduplicated quadtrees...\n");
+    
+    // Every 8x8 square of the checkerboard is the same leaf
+    Image *board = create_test_image(256, 256);
+    QTNode *root = create_quadtree(board, 0.0);
+    QTDag *dag = dag_from_quadtree(root);
+    assert(dag != NULL && dag->count < 20);
+    assert(save_dag_qtree(dag, "tests/output/board.qtd"));
+    assert(save_preorder_qt_binary(root, "tests/output/board.qtb"));
+    assert(file_size("tests/output/board.qtd") * 10 < file_size("tests/output/board.qtb"));
+    delete_dag_quadtree(dag);
+    check_dag_round_trip(root);
+    delete_quadtree(root);
+    delete_image(board);
+    
+    double rmse_values[] = {0.0, 10.0, 50.0};
+    for (int i = 0; i < TEST_IMAGE_COUNT; i++) {
+        Image *image = load_test_image(test_images[i]);
+        for (int j = 0; j < 3; j++) {
+            root = create_quadtree(image, rmse_values[j]);
+            check_dag_round_trip(root);
+            delete_quadtree(root);
+        }
+        delete_image(image);
+    }
+    
+    // Odd sizes
+    Image *odd = create_test_image(37, 13);
+    root = create_quadtree(odd, 0.0);
+    check_dag_round_trip(root);
+    delete_quadtree(root);
+    delete_image(odd);
+
+    // The 4x3 and 4x4 top quadrants share one DAG node, which the file must
+    // write out again for the second size rather than refer back to
+    Image *quads = create_test_image(7, 8);
+    for (unsigned int k = 0; k < 7 * 8; k++) {
+        quads->pixels[k] = k < 7 * 2 ? 10 : k < 7 * 4 ? 30 : 0;
+    }
+    root = create_quadtree(quads, 0.0);
+    dag = dag_from_quadtree(root);
+    assert(dag != NULL);
+    assert(dag->nodes[dag->count - 1].child[0] == dag->nodes[dag->count - 1].child[1]);
+    delete_dag_quadtree(dag);
+    check_dag_round_trip(root);
+    delete_quadtree(root);
+    delete_image(quads);
+    
+    // Truncated and missing files
+    FILE *in = fopen("tests/output/board.qtd", "rb");
+    FILE *out = fopen("tests/output/truncated.qtd", "wb");
+    char buffer[64];
+    size_t n = fread(buffer, 1, sizeof(buffer), in);
+    fwrite(buffer, 1, n - 1, out);
+    fclose(in);
+    fclose(out);
+    assert(load_dag_qtree("tests/output/truncated.qtd") == NULL);
+    assert(load_dag_qtree("nonexistent.qtd") == NULL);
+
+    // A 7x8 image whose 4x3 top-left quadrant splits down to a 2x1 region.
+    // Referring back to it is fine for the 4x3 bottom-left quadrant, but not
+    // for the 4x4 top-right one, whose 2x2 corner the 2x1 subtree cannot fill.
+    FILE *fp = fopen("tests/output/ref_ok.qtd", "wb");
+    fwrite("QTD1\x07\0\0\0\x08\0\0\0\x15\x64\x64\x64\x00\x00\xc8\x32\x32\x32\x08\x0a\x01\x0a",
+           1, 26, fp);
+    fclose(fp);
+    fp = fopen("tests/output/ref_mismatch.qtd", "wb");
+    fwrite("QTD1\x07\0\0\0\x08\0\0\0\x15\x64\x64\x64\x00\x00\xc8\x32\x32\x32\x02\x01\x0a\x0a",
+           1, 26, fp);
+    fclose(fp);
+    dag = load_dag_qtree("tests/output/ref_ok.qtd");
+    assert(dag != NULL);
+    root = quadtree_from_dag(dag);
+    assert(root != NULL);
+    delete_quadtree(root);
+    delete_dag_quadtree(dag);
+    assert(load_dag_qtree("tests/output/ref_mismatch.qtd") == NULL);
+    assert(dag_from_quadtree(NULL) == NULL);
+    
+    printf("Deduplicated quadtree tests passed!\n");
+}
+
+// Appends the address of every node of root's tree to *nodes.
+static void collect_nodes(QTNode *root, QTNode ***nodes, size_t *count, size_t *capacity) {
+    if (!root) return;
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 1024;
+        *nodes = realloc(*nodes, *capacity * sizeof(QTNode *));
+        assert(*nodes != NULL);
+    }
+    (*nodes)[(*count)++] = root;
+    collect_nodes(root->child1, nodes, count, capacity);
+    collect_nodes(root->child2, nodes, count, capacity);
+    collect_nodes(root->child3, nodes, count, capacity);
+    collect_nodes(root->child4, nodes, count, capacity);
+}
+
+static int compare_node_addresses(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(QTNode *const *)a, y = (uintptr_t)*(QTNode *const *)b;
+    return (x > y) - (x < y);
+}
+
+void test_qtree_update() {
+    printf("\nTesting incremental quadtree updates...\n");
+    
+    double rmse_values[] = {0.0, 0.5, 10.0, 25.0, 255.0};
+    unsigned int rects[][4] = {
+        {100, 80, 50, 50},      // Interior
+        {0, 0, 1, 1},           // Single corner pixel
+        {200, 230, 56, 26},     // Touching the right and bottom edges
+        {17, 3, 9, 200},        // Long thin strip
+        {0, 0, 256, 256}        // Everything
+    };
+    for (int i = 0; i < TEST_IMAGE_COUNT; i++) {
+        for (int j = 0; j < 5; j++) {
+            Image *image = load_test_image(test_images[i]);
+            QTNode *root = create_quadtree(image, rmse_values[j]);
+            
+            // Each change builds on the previous ones
+            for (int k = 0; k < 5; k++) {
+                unsigned int row = rects[k][0], col = rects[k][1];
+                unsigned int height = rects[k][2], width = rects[k][3];
+                for (unsigned int r = row; r < row + height && r < image->height; r++) {
+                    for (unsigned int c = col; c < col + width && c < image->width; c++) {
+                        unsigned char *pixel = &image->pixels[(size_t)r * image->width + c];
+                        *pixel = (k % 2) ? (unsigned char)(255 - *pixel)
+                                         : (unsigned char)((r * 7 + c * 3) % 256);
+                    }
+                }
+                assert(qtree_update(root, image, row, col, height, width, rmse_values[j]));
+                
+                QTNode *expected = create_quadtree(image, rmse_values[j]);
+                assert_same_tree(expected, root);
+                delete_quadtree(expected);
+            }
+            delete_quadtree(root);
+            delete_image(image);
+        }
+    }
+    
+    // Toggling a busy patch on and off reuses the nodes each edit drops
+    Image *image = load_test_image("building1.ppm");
+    QTNode *root = create_quadtree(image, 10.0);
+    size_t max_nodes = count_nodes(root);
+    size_t seen_count = 0, seen_capacity = 0;
+    QTNode **seen = NULL;
+    for (int k = 0; k < 40; k++) {
+        for (unsigned int r = 100; r < 150; r++) {
+            for (unsigned int c = 80; c < 130; c++) {
+                unsigned char *pixel = &image->pixels[(size_t)r * image->width + c];
+                *pixel = (unsigned char)(*pixel ^ ((r + c) % 2 ? 0x80 : 0x40));
+            }
+        }
+        assert(qtree_update(root, image, 100, 80, 50, 50, 10.0));
+        collect_nodes(root, &seen, &seen_count, &seen_capacity);
+        if (count_nodes(root) > max_nodes) max_nodes = count_nodes(root);
+    }
+    qsort(seen, seen_count, sizeof(QTNode *), compare_node_addresses);
+    size_t distinct = seen_count > 0;
+    for (size_t k = 1; k < seen_count; k++) distinct += seen[k] != seen[k - 1];
+    assert(distinct < 2 * max_nodes);
+    free(seen);
+    delete_quadtree(root);
+    delete_image(image);
+    
+    // A tree loaded from a file, and a mismatched image
+    image = create_test_image(37, 13);
+    root = create_quadtree(image, 10.0);
+    save_preorder_qt_binary(root, "tests/output/update.qtb");
+    delete_quadtree(root);
+    root = load_preorder_qt_binary("tests/output/update.qtb");
+    image->pixels[5 * 37 + 20] = 128;
+    assert(qtree_update(root, image, 5, 20, 1, 1, 10.0));
+    QTNode *expected = create_quadtree(image, 10.0);
+    assert_same_tree(expected, root);
+    delete_quadtree(expected);
+    
+    // A rectangle running past the bottom-right corner is clipped, not wrapped
+    image->pixels[12 * 37 + 36] = 77;
+    assert(qtree_update(root, image, 12, 30, UINT_MAX, UINT_MAX, 10.0));
+    expected = create_quadtree(image, 10.0);
+    assert_same_tree(expected, root);
+    delete_quadtree(expected);
+    image->pixels[0] = 200;
+    assert(qtree_update(root, image, 0, 0, UINT_MAX, 1, 10.0));
+    expected = create_quadtree(image, 10.0);
+    assert_same_tree(expected, root);
+    delete_quadtree(expected);
+    
+    Image *other = create_test_image(13, 37);
+    assert(!qtree_update(root, other, 0, 0, 1, 1, 10.0));
+    assert(!qtree_update(NULL, image, 0, 0, 1, 1, 10.0));
+    delete_image(other);
+    delete_quadtree(root);
+    delete_image(image);
+    
+    printf("Incremental quadtree update tests passed!\n");
+}
+
+void test_qtree_sequence() {
+    printf("\nTesting quadtree sequences...\n");
+    
+    // A mostly static scene: a small square moves across building1.ppm
+    prepare_input_image_file("building1.ppm");
+    Image *image = load_image("images/building1.ppm");
+    unsigned int width = get_image_width(image), height = get_image_height(image);
+    const int nframes = 8;
+    QTNode *frames[8];
+    long full_size = 0;
+    
+    QTSequenceWriter *writer = open_qtree_sequence_writer("tests/output/sequence.qts",
+                                                          width, height);
+    assert(writer != NULL);
+    for (int f = 0; f < nframes; f++) {
+        Image *frame = load_image("images/building1.ppm");
+        if (f != 3) {   // Frame 3 equals the one before it
+            for (unsigned int r = 40; r < 60; r++) {
+                for (unsigned int c = 10 + 20 * (unsigned int)f; c < 30 + 20 * (unsigned int)f; c++) {
+                    frame->pixels[(size_t)r * width + c] = 255;
+                }
+            }
+        } else {
+            for (unsigned int r = 40; r < 60; r++) {
+                for (unsigned int c = 50; c < 70; c++) frame->pixels[(size_t)r * width + c] = 255;
+            }
+        }
+        frames[f] = create_quadtree(frame, 10.0);
+        assert(write_qtree_sequence_frame(writer, frames[f]));
+        assert(save_preorder_qt_binary(frames[f], "tests/output/sequence_frame.qtb"));
+        full_size += file_size("tests/output/sequence_frame.qtb");
+        delete_image(frame);
+    }
+    Image *other = create_test_image(width + 1, height);
+    QTNode *wrong_size = create_quadtree(other, 10.0);
+    assert(!write_qtree_sequence_frame(writer, wrong_size));
+    delete_quadtree(wrong_size);
+    delete_image(other);
+    assert(close_qtree_sequence_writer(writer));
+    assert(file_size("tests/output/sequence.qts") * 4 < full_size);
+    
+    QTSequenceReader *reader = open_qtree_sequence_reader("tests/output/sequence.qts");
+    assert(reader != NULL);
+    for (int f = 0; f < nframes; f++) {
+        QTLinearTree *tree = read_qtree_sequence_frame(reader);
+        assert(tree != NULL);
+        QTNode *root = quadtree_from_linear(tree);
+        assert_same_tree(frames[f], root);
+        delete_quadtree(root);
+    }
+    assert(read_qtree_sequence_frame(reader) == NULL);
+    close_qtree_sequence_reader(reader);
+    
+    // A truncated file yields the frames before the cut
+    FILE *in = fopen("tests/output/sequence.qts", "rb");
+    FILE *out = fopen("tests/output/sequence_cut.qts", "wb");
+    long cut = file_size("tests/output/sequence.qts") - 3;
+    for (long i = 0; i < cut; i++) fputc(fgetc(in), out);
+    fclose(in);
+    fclose(out);
+    reader = open_qtree_sequence_reader("tests/output/sequence_cut.qts");
+    int decoded = 0;
+    while (read_qtree_sequence_frame(reader)) decoded++;
+    assert(decoded == nframes - 1);
+    close_qtree_sequence_reader(reader);
+    
+    assert(open_qtree_sequence_reader("nonexistent.qts") == NULL);
+    for (int f = 0; f < nframes; f++) delete_quadtree(frames[f]);
+    delete_image(image);
+    
+    printf("Quadtree sequence tests passed!\n");
+}
+
+void test_lossless_qt() {
+    printf("\nTesting lossless quadtree archives...\n");
+    
+    const double max_rmses[] = {0, 5, 25, 1000};
+    for (int f = 0; f < TEST_IMAGE_COUNT; f++) {
+        Image *image = load_test_image(test_images[f]);
+        assert(save_image(image, "tests/output/lossless.pgm", PNM_P5));
+        long p5_size = file_size("tests/output/lossless.pgm");
+        
+        for (int k = 0; k < 4; k++) {
+            assert(save_lossless_qt(image, max_rmses[k], "tests/output/lossless.qtl"));
+            assert(file_size("tests/output/lossless.qtl") < p5_size);
+            Image *loaded = load_lossless_qt("tests/output/lossless.qtl");
+            assert(loaded != NULL);
+            assert(compare_images(image, loaded));
+            delete_image(loaded);
+            
+            QTNode *expected = create_quadtree(image, max_rmses[k]);
+            QTNode *base = load_lossless_qt_base("tests/output/lossless.qtl");
+            assert_same_tree(expected, base);
+            delete_quadtree(expected);
+            delete_quadtree(base);
+        }
+        
+        // Tiled images archive the same pixels
+        assert(set_image_layout(image, IMAGE_TILED));
+        assert(save_lossless_qt(image, 10, "tests/output/lossless.qtl"));
+        Image *loaded = load_lossless_qt("tests/output/lossless.qtl");
+        assert(compare_images(image, loaded));
+        delete_image(loaded);
+        delete_image(image);
+    }
+    
+    unsigned int sizes[][2] = {{1, 1}, {1, 7}, {13, 5}, {33, 17}};
+    for (int s = 0; s < 4; s++) {
+        Image *image = create_test_image(sizes[s][0], sizes[s][1]);
+        assert(save_lossless_qt(image, 3, "tests/output/lossless.qtl"));
+        Image *loaded = load_lossless_qt("tests/output/lossless.qtl");
+        assert(loaded != NULL);
+        assert(compare_images(image, loaded));
+        delete_image(loaded);
+        delete_image(image);
+    }
+    
+    // A truncated archive is rejected rather than decoded short
+    FILE *in = fopen("tests/output/lossless.qtl", "rb");
+    FILE *out = fopen("tests/output/lossless_cut.qtl", "wb");
+    long cut = file_size("tests/output/lossless.qtl") / 2;
+    for (long i = 0; i < cut; i++) fputc(fgetc(in), out);
+    fclose(in);
+    fclose(out);
+    assert(load_lossless_qt("tests/output/lossless_cut.qtl") == NULL);
+    assert(load_lossless_qt("nonexistent.qtl") == NULL);
+    assert(load_lossless_qt_base("nonexistent.qtl") == NULL);
+    assert(!save_lossless_qt(NULL, 0, "tests/output/lossless.qtl"));
+    
+    printf("Lossless quadtree tests passed!\n");
+}
+
 void test_preorder_output(QTNode *root, char *expected_filename) {
     // First save our tree
     save_preorder_qt(root, "tests/output/test_preorder.txt");
@@ -521,6 +1856,30 @@ int main() {
     test_quadtree_moderate();
     test_steganography_moderate();
 
+    test_quadtree_parallel();
+    test_delete_subtree();
+    test_binary_formats();
+    test_save_qtree_as_ppm_expected();
+    test_binary_preorder();
+    test_compressed_preorder();
+    test_render_preorder();
+    test_encode_preorder();
+    test_linear_quadtree();
+    test_multi_quadtree();
+    test_quadtree_budget();
+    test_qtree_queries();
+    test_qtree_lod();
+    test_qtree_render();
+    test_qtree_render_parallel();
+    test_load_image_parallel();
+    test_quadtree_tiled();
+    test_image_layout();
+    test_quadtree_bottom_up();
+    test_dag_quadtree();
+    test_qtree_update();
+    test_qtree_sequence();
+    test_lossless_qt();
+
     printf("\nAll tests completed successfully!\n");
     return 0;
 }
\ No newline at end of file
@@ -1,81 +1,741 @@
 #include "image.h"
+#include "thread_pool.h"
+#include <pthread.h>
 #include <string.h>
 #include <stdint.h>
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Size of the buffer the PNM writers fill before calling write(2).
+#define PNM_WRITE_BUFFER (1 << 20)
+
+// Largest width or height accepted, keeping pixel counts below 2^40 so the
+// quadtree's 64-bit sums of squares cannot overflow.
+#define PNM_MAX_SIDE (1 << 20)
+
+// P3 bodies smaller than this are parsed on the calling thread even by
+// load_image_parallel.
+#define P3_PARALLEL_MIN_BYTES (1 << 22)
+
+// Chunks per pool worker when parsing a P3 body in parallel.
+#define P3_CHUNKS_PER_THREAD 4
+
+// Longest P3 text of one pixel: "255 255 255 " and a row-ending newline.
+#define P3_MAX_PIXEL_TEXT 13
+
+// Bands each pool worker may have formatted or in progress ahead of the
+// band save_pnm_parallel is writing.
+#define PNM_BANDS_PER_THREAD 2
+
+// Arrangement of P3 pixel triples in the text body. Each writer keeps the
+// layout its files have always had.
+typedef enum P3Layout {
+    P3_LAYOUT_ROWS,             // "v v v " per pixel, newline after each row
+    P3_LAYOUT_SEPARATED_ROWS,   // Triples separated by spaces, rows by newlines
+    P3_LAYOUT_FLAT              // "v v v " per pixel, no newlines
+} P3Layout;
+
+// Read-only view of a whole file: memory-mapped when possible, otherwise
+// read into a heap buffer.
+typedef struct FileView {
+    const char *data;
+    size_t size;
+    int mapped;
+} FileView;
+
+// Cursor over ASCII PPM text. scan_int mirrors fscanf's "%d": it skips
+// whitespace, takes an optional sign and at least one digit, and stops at
+// the first non-digit without consuming it.
+typedef struct TextScanner {
+    const char *pos;
+    const char *end;
+} TextScanner;
+
+// A whitespace-aligned piece of a P3 body. The first pass counts its runs of
+// non-whitespace; the second parses them as samples first, first + 1, ...
+// of the body, failing unless every run is exactly one valid sample.
+typedef struct P3Chunk {
+    const char *start;
+    const char *end;
+    size_t runs;
+    size_t first;
+    size_t needed;          // Samples the image needs in total
+    unsigned char *pixels;
+    int failed;
+} P3Chunk;
+
+static int open_file_view(char *filename, FileView *view) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return 0;
+    }
+    view->size = (size_t)st.st_size;
+
+    void *map = mmap(NULL, view->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+        madvise(map, view->size, MADV_SEQUENTIAL);
+        view->data = map;
+        view->mapped = 1;
+        close(fd);
+        return 1;
+    }
 
-Image *load_image(char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) return NULL;
+    // Not mappable (pipes, some special files): fall back to reading it
+    char *buffer = malloc(view->size);
+    size_t total = 0;
+    while (buffer && total < view->size) {
+        ssize_t n = read(fd, buffer + total, view->size - total);
+        if (n <= 0) break;
+        total += (size_t)n;
+    }
+    close(fd);
+    if (!buffer || total == 0) {
+        free(buffer);
+        return 0;
+    }
+    view->data = buffer;
+    view->size = total;
+    view->mapped = 0;
+    return 1;
+}
 
-    Image *img = malloc(sizeof(Image));
-    if (!img) {
-        fclose(fp);
-        return NULL;
+static void close_file_view(FileView *view) {
+    if (view->mapped) {
+        munmap((void *)view->data, view->size);
+    } else {
+        free((void *)view->data);
     }
+}
 
-    // Read magic number
-    char magic[3];
-    if (fscanf(fp, "%2s", magic) != 1 || magic[0] != 'P' || magic[1] != '3') {
-        free(img);
-        fclose(fp);
-        return NULL;
+static inline int is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline int scan_int(TextScanner *scanner, int *value) {
+    const char *p = scanner->pos;
+    const char *end = scanner->end;
+
+    while (p < end && is_space(*p)) p++;
+    if (p == end) return 0;
+
+    int negative = 0;
+    if (*p == '-' || *p == '+') {
+        negative = (*p == '-');
+        p++;
+    }
+    if (p == end || (unsigned)(*p - '0') > 9) return 0;
+
+    // Saturate instead of overflowing; anything this large fails validation
+    long magnitude = 0;
+    while (p < end && (unsigned)(*p - '0') <= 9) {
+        if (magnitude < 100000000L) magnitude = magnitude * 10 + (*p - '0');
+        p++;
+    }
+
+    scanner->pos = p;
+    *value = (int)(negative ? -magnitude : magnitude);
+    return 1;
+}
+
+// scan_int specialised for pixel samples: the common unsigned case is parsed
+// inline and values above 255 fail early, which load_image would reject
+// anyway. Signed tokens go through scan_int.
+static inline int scan_sample(TextScanner *scanner, int *value) {
+    const char *p = scanner->pos;
+    const char *end = scanner->end;
+
+    while (p < end && is_space(*p)) p++;
+    if (p == end) return 0;
+
+    unsigned int digit = (unsigned int)(*p - '0');
+    if (digit > 9) {
+        scanner->pos = p;
+        return scan_int(scanner, value) && *value >= 0 && *value <= 255;
+    }
+
+    unsigned int sample = digit;
+    for (p++; p < end && (digit = (unsigned int)(*p - '0')) <= 9; p++) {
+        sample = sample * 10 + digit;
+        if (sample > 255) return 0;
+    }
+
+    scanner->pos = p;
+    *value = (int)sample;
+    return 1;
+}
+
+// Stores the first of every three samples, the red channel.
+static int parse_p3_pixels(TextScanner *scanner, unsigned char *pixels, size_t num_pixels) {
+    for (size_t i = 0; i < num_pixels; i++) {
+        int r, g, b;
+        if (!scan_sample(scanner, &r) || !scan_sample(scanner, &g) ||
+            !scan_sample(scanner, &b)) {
+            return 0;
+        }
+        pixels[i] = (unsigned char)r;  // Store grayscale value
+    }
+    return 1;
+}
+
+static void count_p3_runs_task(void *arg) {
+    P3Chunk *chunk = arg;
+    size_t runs = 0;
+    int in_run = 0;
+    for (const char *p = chunk->start; p < chunk->end; p++) {
+        int space = is_space(*p);
+        runs += !space && !in_run;
+        in_run = !space;
+    }
+    chunk->runs = runs;
+}
+
+static void parse_p3_chunk_task(void *arg) {
+    P3Chunk *chunk = arg;
+    if (chunk->first >= chunk->needed) return;
+
+    size_t last = chunk->first + chunk->runs;
+    if (last > chunk->needed) last = chunk->needed;
+
+    TextScanner scanner = {chunk->start, chunk->end};
+    for (size_t k = chunk->first; k < last; k++) {
+        int value;
+        if (!scan_sample(&scanner, &value) ||
+            (scanner.pos < scanner.end && !is_space(*scanner.pos))) {
+            chunk->failed = 1;
+            return;
+        }
+        if (k % 3 == 0) chunk->pixels[k / 3] = (unsigned char)value;
+    }
+}
+
+// parse_p3_pixels split over a pool. The result is only used when each run
+// of non-whitespace in the needed part of the body is exactly one sample;
+// for anything else, such as short or malformed bodies or tokens like
+// "1+2", the body is parsed again serially so results and errors match
+// load_image exactly.
+static int parse_p3_pixels_parallel(TextScanner *scanner, unsigned char *pixels,
+                                    size_t num_pixels, unsigned int nthreads) {
+    ThreadPool *pool = thread_pool_create(nthreads);
+    if (!pool) return parse_p3_pixels(scanner, pixels, num_pixels);
+
+    unsigned int nchunks = thread_pool_size(pool) * P3_CHUNKS_PER_THREAD;
+    P3Chunk *chunks = calloc(nchunks, sizeof(P3Chunk));
+    if (!chunks) {
+        thread_pool_destroy(pool);
+        return parse_p3_pixels(scanner, pixels, num_pixels);
+    }
+
+    // Chunk boundaries move forward to just past a whitespace byte, so no
+    // run is split
+    size_t size = (size_t)(scanner->end - scanner->pos);
+    const char *start = scanner->pos;
+    for (unsigned int c = 0; c < nchunks; c++) {
+        const char *end = scanner->pos + (size_t)((uint64_t)size * (c + 1) / nchunks);
+        if (end < start) end = start;
+        while (end < scanner->end && !is_space(end[-1])) end++;
+
+        chunks[c].start = start;
+        chunks[c].end = end;
+        chunks[c].needed = num_pixels * 3;
+        chunks[c].pixels = pixels;
+        start = end;
+    }
+
+    for (unsigned int c = 0; c < nchunks; c++) {
+        if (!thread_pool_submit(pool, count_p3_runs_task, &chunks[c])) {
+            count_p3_runs_task(&chunks[c]);
+        }
+    }
+    thread_pool_wait(pool);
+
+    size_t first = 0;
+    for (unsigned int c = 0; c < nchunks; c++) {
+        chunks[c].first = first;
+        first += chunks[c].runs;
     }
+    int ok = first >= num_pixels * 3;
+
+    if (ok) {
+        for (unsigned int c = 0; c < nchunks; c++) {
+            if (!thread_pool_submit(pool, parse_p3_chunk_task, &chunks[c])) {
+                parse_p3_chunk_task(&chunks[c]);
+            }
+        }
+        thread_pool_wait(pool);
+        for (unsigned int c = 0; c < nchunks; c++) {
+            if (chunks[c].failed) ok = 0;
+        }
+    }
+
+    thread_pool_destroy(pool);
+    free(chunks);
+    return ok || parse_p3_pixels(scanner, pixels, num_pixels);
+}
+
+// Parses the header up to the last byte of the max value. The max value must
+// be 255.
+static int parse_pnm_header(TextScanner *scanner, PNMFormat *format, unsigned int *width,
+                            unsigned int *height) {
+    // Read magic number: like "%2s", up to two characters after whitespace
+    while (scanner->pos < scanner->end && is_space(*scanner->pos)) scanner->pos++;
+    char magic[3] = {0, 0, 0};
+    for (int i = 0; i < 2 && scanner->pos < scanner->end && !is_space(*scanner->pos); i++) {
+        magic[i] = *scanner->pos++;
+    }
+    if (magic[0] != 'P' || (magic[1] != '3' && magic[1] != '5' && magic[1] != '6')) {
+        return 0;
+    }
+    *format = (PNMFormat)(magic[1] - '0');
 
     // Skip whitespace and comments
-    int c;
-    while ((c = fgetc(fp)) != EOF) {
-        if (c == '#') {
+    while (scanner->pos < scanner->end) {
+        if (*scanner->pos == '#') {
             // Skip until end of line
-            while ((c = fgetc(fp)) != EOF && c != '\n');
-        } else if (!isspace(c)) {
-            ungetc(c, fp);
+            while (scanner->pos < scanner->end && *scanner->pos++ != '\n');
+        } else if (is_space(*scanner->pos)) {
+            scanner->pos++;
+        } else {
             break;
         }
     }
 
     // Read dimensions and max value
-    int width, height, max_val;
-    if (fscanf(fp, "%d %d %d", &width, &height, &max_val) != 3 ||
-        width <= 0 || height <= 0 || width > 4096 || height > 4096 ||
-        max_val != 255) {
-        free(img);
-        fclose(fp);
+    int w, h, max_val;
+    if (!scan_int(scanner, &w) || !scan_int(scanner, &h) || !scan_int(scanner, &max_val) ||
+        w <= 0 || h <= 0 || w > PNM_MAX_SIDE || h > PNM_MAX_SIDE || max_val != 255) {
+        return 0;
+    }
+    *width = (unsigned int)w;
+    *height = (unsigned int)h;
+    return 1;
+}
+
+// Reads P3, P5 or P6 and reports which one it was through format. Colour
+// files keep the red channel, matching the grayscale convention of the
+// writers, which repeat the intensity in all three channels.
+static Image *load_pnm(char *filename, PNMFormat *format, unsigned int nthreads) {
+    FileView view;
+    if (!open_file_view(filename, &view)) return NULL;
+
+    TextScanner scanner = {view.data, view.data + view.size};
+    unsigned int width, height;
+    Image *img = parse_pnm_header(&scanner, format, &width, &height)
+        ? create_image(width, height) : NULL;
+    if (!img) {
+        close_file_view(&view);
         return NULL;
     }
+    size_t num_pixels = (size_t)width * height;
+
+    // Binary pixel data starts after exactly one whitespace byte
+    if (*format != PNM_P3) {
+        size_t channels = (*format == PNM_P6) ? 3 : 1;
+        size_t available = (size_t)(scanner.end - scanner.pos);
+        if (available < 1 || !is_space(*scanner.pos) ||
+            (available - 1) / channels < num_pixels) {
+            delete_image(img);
+            close_file_view(&view);
+            return NULL;
+        }
+
+        const unsigned char *data = (const unsigned char *)scanner.pos + 1;
+        if (channels == 1) {
+            memcpy(img->pixels, data, num_pixels);
+        } else {
+            for (size_t i = 0; i < num_pixels; i++) {
+                img->pixels[i] = data[i * 3];
+            }
+        }
 
-    img->width = (unsigned short)width;
-    img->height = (unsigned short)height;
+        close_file_view(&view);
+        return img;
+    }
 
-    // Allocate pixel array
-    size_t num_pixels = (size_t)img->width * (size_t)img->height;
-    if (num_pixels > SIZE_MAX / sizeof(unsigned char)) {
-        free(img);
-        fclose(fp);
+    // Read pixel data
+    int parsed = (nthreads != 1 && scanner.end - scanner.pos >= P3_PARALLEL_MIN_BYTES)
+        ? parse_p3_pixels_parallel(&scanner, img->pixels, num_pixels, nthreads)
+        : parse_p3_pixels(&scanner, img->pixels, num_pixels);
+    if (!parsed) {
+        delete_image(img);
+        close_file_view(&view);
         return NULL;
     }
 
-    img->pixels = malloc(num_pixels * sizeof(unsigned char));
-    if (!img->pixels) {
-        free(img);
-        fclose(fp);
+    close_file_view(&view);
+    return img;
+}
+
+Image *load_image(char *filename) {
+    PNMFormat format;
+    return load_pnm(filename, &format, 1);
+}
+
+Image *load_image_parallel(char *filename, unsigned int nthreads) {
+    PNMFormat format;
+    return load_pnm(filename, &format, nthreads);
+}
+
+MappedImage *map_image(char *filename) {
+    if (!filename) return NULL;
+
+    MappedImage *image = malloc(sizeof(MappedImage));
+    if (!image) return NULL;
+
+    FileView view;
+    if (!open_file_view(filename, &view)) {
+        free(image);
         return NULL;
     }
 
-    // Read pixel data
-    for (size_t i = 0; i < num_pixels; i++) {
-        int r, g, b;
-        if (fscanf(fp, "%d %d %d", &r, &g, &b) != 3 ||
-            r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
-            free(img->pixels);
-            free(img);
-            fclose(fp);
-            return NULL;
+    // Binary pixel data starts after exactly one whitespace byte
+    TextScanner scanner = {view.data, view.data + view.size};
+    PNMFormat format;
+    if (!parse_pnm_header(&scanner, &format, &image->width, &image->height) ||
+        format == PNM_P3 || scanner.pos == scanner.end || !is_space(*scanner.pos)) {
+        close_file_view(&view);
+        free(image);
+        return NULL;
+    }
+
+    image->step = format == PNM_P6 ? 3 : 1;
+    image->row_stride = (size_t)image->width * image->step;
+    size_t available = (size_t)(scanner.end - scanner.pos) - 1;
+    if (available / image->row_stride < image->height) {
+        close_file_view(&view);
+        free(image);
+        return NULL;
+    }
+
+    // Regions are read in no particular order
+    if (view.mapped) madvise((void *)view.data, view.size, MADV_NORMAL);
+    image->pixels = (const unsigned char *)scanner.pos + 1;
+    image->file_data = view.data;
+    image->file_size = view.size;
+    image->file_mapped = view.mapped;
+    return image;
+}
+
+void unmap_image(MappedImage *image) {
+    if (!image) return;
+    FileView view = {image->file_data, image->file_size, image->file_mapped};
+    close_file_view(&view);
+    free(image);
+}
+
+// Text of "v v v " for every intensity, so formatting a P3 pixel is one
+// fixed-size copy. Entries are padded to 16 bytes.
+typedef struct P3Triples {
+    char text[256][16];
+    unsigned char length[256];
+} P3Triples;
+
+// Output file with a large user-space buffer that is handed to write(2) in
+// big chunks.
+typedef struct PNMWriter {
+    int fd;
+    char *buffer;
+    size_t used;
+    int failed;
+} PNMWriter;
+
+// Ordered hand-off between the pool workers formatting bands and the thread
+// writing them.
+typedef struct PNMPipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t band_done;
+} PNMPipeline;
+
+// Rows [first_row, last_row) of a raster, formatted by one pool task into a
+// buffer of their own. text stays NULL if it could not be allocated.
+typedef struct PNMBandTask {
+    PNMPipeline *pipeline;
+    const P3Triples *triples;
+    const unsigned char *pixels;
+    unsigned int width;
+    unsigned int first_row;
+    unsigned int last_row;
+    PNMFormat format;
+    char *text;
+    size_t size;
+    int done;
+} PNMBandTask;
+
+static void build_p3_triples(P3Triples *triples) {
+    for (unsigned int value = 0; value < 256; value++) {
+        int length = snprintf(triples->text[value], sizeof(triples->text[value]),
+                              "%u %u %u ", value, value, value);
+        triples->length[value] = (unsigned char)length;
+    }
+}
+
+static int writer_open(PNMWriter *writer, char *filename) {
+    writer->buffer = malloc(PNM_WRITE_BUFFER);
+    if (!writer->buffer) return 0;
+
+    writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (writer->fd < 0) {
+        free(writer->buffer);
+        return 0;
+    }
+    writer->used = 0;
+    writer->failed = 0;
+    return 1;
+}
+
+static void writer_write(PNMWriter *writer, const char *data, size_t size) {
+    while (size > 0 && !writer->failed) {
+        ssize_t n = write(writer->fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            writer->failed = 1;
+            break;
         }
-        img->pixels[i] = (unsigned char)r;  // Store grayscale value
+        data += n;
+        size -= (size_t)n;
     }
+}
 
-    fclose(fp);
-    return img;
+static void writer_flush(PNMWriter *writer) {
+    writer_write(writer, writer->buffer, writer->used);
+    writer->used = 0;
+}
+
+// Returns 1 when everything reached the file.
+static int writer_close(PNMWriter *writer) {
+    writer_flush(writer);
+    if (close(writer->fd) != 0) writer->failed = 1;
+    free(writer->buffer);
+    return !writer->failed;
+}
+
+// Formats the P3 text of count pixels starting at index first of a raster
+// that is width pixels wide into out, which must have room for
+// P3_MAX_PIXEL_TEXT bytes per pixel. Row ends are detected from the absolute
+// index. Returns the end of the text.
+static char *format_p3_pixels(char *out, const P3Triples *triples,
+                              const unsigned char *pixels, size_t first,
+                              size_t count, unsigned int width, P3Layout layout) {
+    size_t column = first % width;
+
+    for (size_t i = first; i < first + count; i++) {
+        unsigned int value = pixels[i];
+        memcpy(out, triples->text[value], 16);
+        out += triples->length[value];
+
+        if (++column == width) {
+            column = 0;
+            if (layout == P3_LAYOUT_ROWS) {
+                *out++ = '\n';
+            } else if (layout == P3_LAYOUT_SEPARATED_ROWS) {
+                out[-1] = '\n';
+            }
+        }
+    }
+    return out;
+}
+
+static char *format_p6_pixels(char *out, const unsigned char *pixels, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        out[0] = out[1] = out[2] = (char)pixels[i];
+        out += 3;
+    }
+    return out;
+}
+
+// Appends the P3 text of count pixels to the writer's buffer, flushing it
+// whenever the next chunk might not fit.
+static void write_p3_pixels(PNMWriter *writer, const P3Triples *triples,
+                            const unsigned char *pixels, size_t first,
+                            size_t count, unsigned int width, P3Layout layout) {
+    while (count > 0) {
+        // The copy of the last triple may write up to 16 bytes
+        size_t room = (PNM_WRITE_BUFFER - writer->used) / P3_MAX_PIXEL_TEXT;
+        if (room < 2) {
+            writer_flush(writer);
+            continue;
+        }
+        size_t chunk = count < room - 1 ? count : room - 1;
+        char *end = format_p3_pixels(writer->buffer + writer->used, triples, pixels,
+                                     first, chunk, width, layout);
+        writer->used = (size_t)(end - writer->buffer);
+        first += chunk;
+        count -= chunk;
+    }
+}
+
+// Writes a grayscale raster as P3, P5 or P6. Binary formats are written
+// straight from the raster; P3 repeats every intensity three times and
+// arranges the triples as the layout says.
+static int write_pnm_file(char *filename, const unsigned char *pixels,
+                          unsigned int width, unsigned int height,
+                          PNMFormat format, P3Layout layout) {
+    if (!filename || !pixels) return 0;
+
+    PNMWriter writer;
+    if (!writer_open(&writer, filename)) return 0;
+
+    size_t num_pixels = (size_t)width * height;
+    writer.used = (size_t)snprintf(writer.buffer, PNM_WRITE_BUFFER, "P%d\n%u %u\n255\n",
+                                   (int)format, width, height);
+
+    if (format == PNM_P5) {
+        writer_flush(&writer);
+        writer_write(&writer, (const char *)pixels, num_pixels);
+    } else if (format == PNM_P6) {
+        for (size_t i = 0; i < num_pixels; ) {
+            size_t room = (PNM_WRITE_BUFFER - writer.used) / 3;
+            if (room == 0) {
+                writer_flush(&writer);
+                continue;
+            }
+            size_t chunk = num_pixels - i < room ? num_pixels - i : room;
+            format_p6_pixels(writer.buffer + writer.used, pixels + i, chunk);
+            writer.used += chunk * 3;
+            i += chunk;
+        }
+    } else if (num_pixels > 0) {
+        P3Triples triples;
+        build_p3_triples(&triples);
+        write_p3_pixels(&writer, &triples, pixels, 0, num_pixels, width, layout);
+    }
+
+    return writer_close(&writer);
+}
+
+int save_pnm(char *filename, unsigned char *pixels, unsigned int width,
+             unsigned int height, PNMFormat format) {
+    return write_pnm_file(filename, pixels, width, height, format, P3_LAYOUT_ROWS);
+}
+
+static void format_band_task(void *arg) {
+    PNMBandTask *band = arg;
+    size_t first = (size_t)band->first_row * band->width;
+    size_t count = (size_t)(band->last_row - band->first_row) * band->width;
+    size_t bytes_per_pixel = band->format == PNM_P6 ? 3 : P3_MAX_PIXEL_TEXT;
+
+    band->text = malloc(count * bytes_per_pixel + 16);
+    if (band->text) {
+        char *end = band->format == PNM_P6
+            ? format_p6_pixels(band->text, band->pixels + first, count)
+            : format_p3_pixels(band->text, band->triples, band->pixels, first, count,
+                               band->width, P3_LAYOUT_ROWS);
+        band->size = (size_t)(end - band->text);
+    }
+
+    pthread_mutex_lock(&band->pipeline->lock);
+    band->done = 1;
+    pthread_cond_broadcast(&band->pipeline->band_done);
+    pthread_mutex_unlock(&band->pipeline->lock);
+}
+
+// save_pnm with P3 text formatting or P6 triple expansion done by a pool, a
+// band of rows per task. Bands are written in order as they complete, and only a few per
+// worker are in flight, so memory stays bounded for any image size.
+int save_pnm_parallel(char *filename, unsigned char *pixels, unsigned int width,
+                      unsigned int height, PNMFormat format, unsigned int nthreads) {
+    if (format == PNM_P5 || nthreads == 1 || width == 0 || height == 0) {
+        return save_pnm(filename, pixels, width, height, format);
+    }
+    if (!filename || !pixels) return 0;
+
+    ThreadPool *pool = thread_pool_create(nthreads);
+    if (!pool) return save_pnm(filename, pixels, width, height, format);
+
+    // Bands of about one write buffer of text
+    unsigned int band_rows = (unsigned int)(PNM_WRITE_BUFFER / ((size_t)width * P3_MAX_PIXEL_TEXT));
+    if (band_rows == 0) band_rows = 1;
+    unsigned int nbands = (height - 1) / band_rows + 1;
+    unsigned int window = thread_pool_size(pool) * PNM_BANDS_PER_THREAD;
+
+    P3Triples *triples = malloc(sizeof(P3Triples));
+    PNMBandTask *bands = calloc(nbands, sizeof(PNMBandTask));
+    PNMWriter writer;
+    if (!triples || !bands || !writer_open(&writer, filename)) {
+        thread_pool_destroy(pool);
+        free(triples);
+        free(bands);
+        return 0;
+    }
+
+    PNMPipeline pipeline;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.band_done, NULL);
+    build_p3_triples(triples);
+    for (unsigned int b = 0; b < nbands; b++) {
+        bands[b] = (PNMBandTask){&pipeline, triples, pixels, width, b * band_rows,
+                                 b == nbands - 1 ? height : (b + 1) * band_rows,
+                                 format, NULL, 0, 0};
+    }
+
+    writer.used = (size_t)snprintf(writer.buffer, PNM_WRITE_BUFFER, "P%d\n%u %u\n255\n",
+                                   (int)format, width, height);
+    writer_flush(&writer);
+
+    unsigned int submitted = 0;
+    for (unsigned int b = 0; b < nbands; b++) {
+        while (submitted < nbands && submitted < b + window) {
+            if (!thread_pool_submit(pool, format_band_task, &bands[submitted])) {
+                format_band_task(&bands[submitted]);
+            }
+            submitted++;
+        }
+
+        pthread_mutex_lock(&pipeline.lock);
+        while (!bands[b].done) pthread_cond_wait(&pipeline.band_done, &pipeline.lock);
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if (!bands[b].text) writer.failed = 1;
+        writer_write(&writer, bands[b].text, bands[b].size);
+        free(bands[b].text);
+        bands[b].text = NULL;
+    }
+
+    thread_pool_wait(pool);
+    thread_pool_destroy(pool);
+    pthread_cond_destroy(&pipeline.band_done);
+    pthread_mutex_destroy(&pipeline.lock);
+    free(triples);
+    free(bands);
+    return writer_close(&writer);
+}
+
+int save_image(Image *image, char *filename, PNMFormat format) {
+    if (!image) return 0;
+    if (image->layout != IMAGE_TILED) {
+        return save_pnm(filename, image->pixels, image->width, image->height, format);
+    }
+
+    unsigned char *pixels = malloc((size_t)image->width * image->height);
+    if (!pixels) return 0;
+    for (unsigned int i = 0; i < image->height; i++) {
+        get_image_row(image, i, pixels + (size_t)i * image->width);
+    }
+    int ok = save_pnm(filename, pixels, image->width, image->height, format);
+    free(pixels);
+    return ok;
+}
+
+Image *create_image(unsigned int width, unsigned int height) {
+    if (width == 0 || height == 0 || (size_t)width > SIZE_MAX / height) return NULL;
+
+    Image *image = malloc(sizeof(Image));
+    if (!image) return NULL;
+    image->pixels = malloc((size_t)width * height);
+    if (!image->pixels) {
+        free(image);
+        return NULL;
+    }
+    image->width = width;
+    image->height = height;
+    image->layout = IMAGE_ROW_MAJOR;
+    return image;
 }
 
 void delete_image(Image *image) {
@@ -85,46 +745,100 @@ void delete_image(Image *image) {
     }
 }
 
+// Blocks per block row of an IMAGE_TILED image.
+static size_t tiles_across(unsigned int width) {
+    return (width + IMAGE_TILE_SIDE - 1) / IMAGE_TILE_SIDE;
+}
+
+// Start of the run of row inside block column tile of an IMAGE_TILED image.
+static unsigned char *tiled_row_start(Image *image, unsigned int row, size_t tile) {
+    size_t block = (size_t)(row / IMAGE_TILE_SIDE) * tiles_across(image->width) + tile;
+    return image->pixels + (block * IMAGE_TILE_SIDE + row % IMAGE_TILE_SIDE) * IMAGE_TILE_SIDE;
+}
+
+int set_image_layout(Image *image, ImageLayout layout) {
+    if (!image || (layout != IMAGE_ROW_MAJOR && layout != IMAGE_TILED)) return 0;
+    if (image->layout == layout) return 1;
+
+    size_t size = (size_t)image->width * image->height;
+    if (layout == IMAGE_TILED) {
+        size_t rows = (image->height + IMAGE_TILE_SIDE - 1) / IMAGE_TILE_SIDE;
+        size = rows * tiles_across(image->width) * IMAGE_TILE_SIDE * IMAGE_TILE_SIDE;
+    }
+    unsigned char *pixels = calloc(size ? size : 1, 1);
+    if (!pixels) return 0;
+
+    Image reordered = *image;
+    reordered.pixels = pixels;
+    reordered.layout = layout;
+    Image *tiled = layout == IMAGE_TILED ? &reordered : image;
+    Image *row_major = layout == IMAGE_TILED ? image : &reordered;
+    for (unsigned int i = 0; i < image->height; i++) {
+        unsigned char *row = row_major->pixels + (size_t)i * image->width;
+        for (unsigned int j = 0; j < image->width; j += IMAGE_TILE_SIDE) {
+            unsigned int count = image->width - j < IMAGE_TILE_SIDE ? image->width - j
+                                                                   : IMAGE_TILE_SIDE;
+            unsigned char *run = tiled_row_start(tiled, i, j / IMAGE_TILE_SIDE);
+            if (layout == IMAGE_TILED) memcpy(run, row + j, count);
+            else memcpy(row + j, run, count);
+        }
+    }
+
+    free(image->pixels);
+    image->pixels = pixels;
+    image->layout = layout;
+    return 1;
+}
+
 unsigned char get_image_intensity(Image *image, unsigned int row, unsigned int col) {
     if (!image || row >= image->height || col >= image->width) 
         return 0;
-    return image->pixels[row * image->width + col];
+    if (image->layout == IMAGE_TILED) {
+        return tiled_row_start(image, row, col / IMAGE_TILE_SIDE)[col % IMAGE_TILE_SIDE];
+    }
+    return image->pixels[(size_t)row * image->width + col];
+}
+
+void get_image_row(Image *image, unsigned int row, unsigned char *out) {
+    if (!image || !out || row >= image->height) return;
+    if (image->layout != IMAGE_TILED) {
+        memcpy(out, image->pixels + (size_t)row * image->width, image->width);
+        return;
+    }
+    for (unsigned int j = 0; j < image->width; j += IMAGE_TILE_SIDE) {
+        unsigned int count = image->width - j < IMAGE_TILE_SIDE ? image->width - j
+                                                               : IMAGE_TILE_SIDE;
+        memcpy(out + j, tiled_row_start(image, row, j / IMAGE_TILE_SIDE), count);
+    }
 }
 
-unsigned short get_image_width(Image *image) {
+unsigned int get_image_width(Image *image) {
     return image ? image->width : 0;
 }
 
-unsigned short get_image_height(Image *image) {
+unsigned int get_image_height(Image *image) {
     return image ? image->height : 0;
 }
 
 unsigned int hide_message(char *message, char *input_filename, char *output_filename) {
     if (!message || !input_filename || !output_filename) return 0;
     
-    Image *img = load_image(input_filename);
+    PNMFormat format;
+    Image *img = load_pnm(input_filename, &format, 1);
     if (!img) return 0;
 
     // Calculate maximum message length (including null terminator)
-    unsigned int max_chars = (img->width * img->height) / 8 - 1;
+    size_t num_pixels = (size_t)img->width * img->height;
+    unsigned int max_chars = (unsigned int)(num_pixels / 8 - 1);
     unsigned int msg_len = strlen(message);
     unsigned int chars_to_hide = (msg_len < max_chars) ? msg_len : max_chars;
 
-    FILE *fp = fopen(output_filename, "w");
-    if (!fp) {
-        delete_image(img);
-        return 0;
-    }
-
-    // Write PPM header
-    fprintf(fp, "P3\n%d %d\n255\n", img->width, img->height);
-
     unsigned int bit_idx = 0;
     unsigned int char_idx = 0;
     unsigned char current_char = message[0];
     
-    // Process all pixels
-    for (unsigned int i = 0; i < img->width * img->height; i++) {
+    // Process all pixels in place; the image is written out afterwards
+    for (size_t i = 0; i < num_pixels; i++) {
         unsigned char pixel = img->pixels[i];
         
         // If we're still hiding message (including null terminator)
@@ -147,16 +861,16 @@ unsigned int hide_message(char *message, char *input_filename, char *output_file
             }
         }
         
-        // Write pixel
-        fprintf(fp, "%d %d %d", pixel, pixel, pixel);
-        if ((i + 1) % img->width == 0) {
-            fprintf(fp, "\n");
-        } else {
-            fprintf(fp, " ");
-        }
+        img->pixels[i] = pixel;
+    }
+
+    // Output keeps the cover image's format
+    if (!write_pnm_file(output_filename, img->pixels, img->width, img->height,
+                        format, P3_LAYOUT_SEPARATED_ROWS)) {
+        delete_image(img);
+        return 0;
     }
 
-    fclose(fp);
     delete_image(img);
     return chars_to_hide;
 }
@@ -168,7 +882,8 @@ char *reveal_message(char *input_filename) {
     if (!img) return NULL;
 
     // Allocate space for the message
-    size_t max_msg_len = (img->width * img->height) / 8;
+    size_t num_pixels = (size_t)img->width * img->height;
+    size_t max_msg_len = num_pixels / 8;
     char *message = malloc(max_msg_len * sizeof(char));
     if (!message) {
         delete_image(img);
@@ -176,11 +891,11 @@ char *reveal_message(char *input_filename) {
     }
 
     unsigned int bit_idx = 0;
-    unsigned int char_idx = 0;
+    size_t char_idx = 0;
     unsigned char current_char = 0;
 
     // Extract message from image pixels
-    for (unsigned int i = 0; i < img->height * img->width && char_idx < max_msg_len - 1; i++) {
+    for (size_t i = 0; i < num_pixels && char_idx < max_msg_len - 1; i++) {
         // Get LSB from current pixel
         current_char = (current_char << 1) | (img->pixels[i] & 1);
         bit_idx++;
@@ -206,8 +921,9 @@ char *reveal_message(char *input_filename) {
 
 
 unsigned int hide_image(char *secret_image_filename, char *input_filename, char *output_filename) {
+    PNMFormat format;
     Image *secret = load_image(secret_image_filename);
-    Image *cover = load_image(input_filename);
+    Image *cover = load_pnm(input_filename, &format, 1);
     
     if (!secret || !cover) {
         delete_image(secret);
@@ -215,65 +931,59 @@ unsigned int hide_image(char *secret_image_filename, char *input_filename, char
         return 0;
     }
 
-    unsigned int required_pixels = 16 + (secret->width * secret->height * 8);
-    if (required_pixels > cover->width * cover->height || 
-        secret->width >= 256 || secret->height >= 256) {
+    size_t cover_pixels = (size_t)cover->width * cover->height;
+    if (secret->width >= 256 || secret->height >= 256 ||
+        16 + (size_t)secret->width * secret->height * 8 > cover_pixels) {
         delete_image(secret);
         delete_image(cover);
         return 0;
     }
 
-    FILE *fp = fopen(output_filename, "w");
-    if (!fp) {
-        delete_image(secret);
-        delete_image(cover);
-        return 0;
-    }
-
-    fprintf(fp, "P3\n%d %d\n255\n", cover->width, cover->height);
-
-    unsigned int pixel_idx = 0;
+    size_t pixel_idx = 0;
     
     // Hide dimensions
     for (int i = 0; i < 16; i++) {
         unsigned char pixel = cover->pixels[pixel_idx];
         unsigned char dim = (i < 8) ? secret->width : secret->height;
-        pixel = (pixel & 0xFE) | ((dim >> (7 - (i % 8))) & 1);
-        fprintf(fp, "%d %d %d ", pixel, pixel, pixel);
+        cover->pixels[pixel_idx] = (pixel & 0xFE) | ((dim >> (7 - (i % 8))) & 1);
         pixel_idx++;
     }
 
     // Hide pixel data
-    for (unsigned int i = 0; i < secret->height * secret->width; i++) {
+    for (size_t i = 0; i < (size_t)secret->height * secret->width; i++) {
         unsigned char secret_pixel = secret->pixels[i];
         
         for (int bit = 7; bit >= 0; bit--) {
-            if (pixel_idx >= cover->width * cover->height) break;
+            if (pixel_idx >= cover_pixels) break;
             
             unsigned char cover_pixel = cover->pixels[pixel_idx];
-            cover_pixel = (cover_pixel & 0xFE) | ((secret_pixel >> bit) & 1);
-            fprintf(fp, "%d %d %d ", cover_pixel, cover_pixel, cover_pixel);
+            cover->pixels[pixel_idx] = (cover_pixel & 0xFE) | ((secret_pixel >> bit) & 1);
             pixel_idx++;
         }
     }
 
-    while (pixel_idx < cover->width * cover->height) {
-        unsigned char pixel = cover->pixels[pixel_idx++];
-        fprintf(fp, "%d %d %d ", pixel, pixel, pixel);
-    }
+    // The remaining cover pixels are written unchanged, in the cover's format
+    unsigned int ok = write_pnm_file(output_filename, cover->pixels, cover->width,
+                                     cover->height, format, P3_LAYOUT_FLAT);
 
-    fclose(fp);
     delete_image(secret);
     delete_image(cover);
-    return 1;
+    return ok;
 }
 
 void reveal_image(char *input_filename, char *output_filename) {
-    Image *img = load_image(input_filename);
+    PNMFormat format;
+    Image *img = load_pnm(input_filename, &format, 1);
     if (!img) return;
 
+    size_t num_pixels = (size_t)img->width * img->height;
+    if (num_pixels < 16) {
+        delete_image(img);
+        return;
+    }
+
     unsigned char width = 0, height = 0;
-    unsigned int pixel_idx = 0;
+    size_t pixel_idx = 0;
 
     for (int i = 0; i < 8; i++) {
         width = (width << 1) | (img->pixels[pixel_idx++] & 1);
@@ -283,25 +993,26 @@ void reveal_image(char *input_filename, char *output_filename) {
         height = (height << 1) | (img->pixels[pixel_idx++] & 1);
     }
 
-    FILE *fp = fopen(output_filename, "w");
-    if (!fp) {
+    unsigned char *secret = malloc((size_t)width * height + 1);
+    if (!secret) {
         delete_image(img);
         return;
     }
 
-    fprintf(fp, "P3\n%d %d\n255\n", width, height);
-
     for (unsigned int i = 0; i < width * height; i++) {
         unsigned char pixel = 0;
         
         for (int bit = 0; bit < 8; bit++) {
-            if (pixel_idx >= img->width * img->height) break;
+            if (pixel_idx >= num_pixels) break;
             pixel = (pixel << 1) | (img->pixels[pixel_idx++] & 1);
         }
         
-        fprintf(fp, "%d %d %d ", pixel, pixel, pixel);
+        secret[i] = pixel;
     }
 
-    fclose(fp);
+    // The revealed image takes the format of the image it was hidden in
+    write_pnm_file(output_filename, secret, width, height, format, P3_LAYOUT_FLAT);
+
+    free(secret);
     delete_image(img);
-}
\ No newline at end of file
+}
@@ -1,308 +1,4003 @@
 #include "qtree.h"
+#include "range_coder.h"
+#include "thread_pool.h"
+#include <limits.h>
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+// Regions with fewer pixels than this are built inline by parallel builds
+// instead of being handed to the pool as separate tasks.
+#define PARALLEL_MIN_REGION (64 * 64)
+
+// Row bands per pool worker in parallel renders, so uneven bands balance out.
+#define RENDER_BANDS_PER_THREAD 4
+
+// Magic numbers opening the binary file formats: compact and entropy-coded
+// preorder trees, DAGs, tree sequences and lossless images.
+#define QT_BINARY_MAGIC "QTB1"
+#define QT_CODED_MAGIC "QTE1"
+#define QT_DAG_MAGIC "QTD1"
+#define QT_SEQUENCE_MAGIC "QTS1"
+#define QT_LOSSLESS_MAGIC "QTL1"
+
+// Split flags are modelled per depth up to this many levels, leaf
+// intensities per class of leaf area (1, 2-3, 4-15, ... pixels).
+#define QT_CODED_DEPTHS 16
+#define QT_CODED_SIZE_CLASSES 8
+
+// Pixel residuals of the lossless format are modelled per class of local
+// activity, the summed magnitude of the left and upper residuals (0, 1, 2-3,
+// 4-7, ... 128 and up).
+#define QT_RESIDUAL_CONTEXTS 9
+
+// Deepest nesting render_preorder_qt accepts from a text tree file. Trees
+// shaped by split_region are about 2 * log2(side) levels deep.
+#define QT_MAX_TEXT_DEPTH 64
+
+// Largest source or output side qtree_render_lod accepts, so the index
+// arithmetic of its scaling fits in 64 bits.
+#define QT_LOD_MAX_SIDE (1u << 30)
+
+// Ancestors remembered between the points of one qtree_sample_batch call.
+// Deeper descents still work; they just start over from the root.
+#define QT_SAMPLE_PATH 64
+
+// Upper bound on the pending regions of a linear scan over a QTLinearTree: a
+// split pops one region and pushes up to four, and split_region trees of
+// 32-bit sizes are at most 64 levels deep.
+#define QT_LINEAR_STACK (3 * 64 + 1)
+
+// Tile area create_quadtree_tiled uses when the caller passes 0.
+#define QT_DEFAULT_TILE_PIXELS (1024 * 1024)
+
+// Arena slabs are 2^shift bytes, aligned to their size. They start small so
+// tiny trees stay cheap and double up to this size.
+#define ARENA_FIRST_SLAB_SHIFT 12
+#define ARENA_MAX_SLAB_SHIFT 22
+
+// Slab allocator owning every node of a tree built or loaded by this module.
+typedef struct QTArena QTArena;
+
+// A contiguous block of nodes, handed out front to back. Its nodes record
+// the slab's size in slab_shift, so masking a node's address finds the slab.
+typedef struct QTSlab {
+    struct QTSlab *next;
+    QTArena *arena;
+    size_t used;
+    size_t capacity;
+    QTNode nodes[];
+} QTSlab;
+
+// Cached totals of one node's region, kept by qtree_update.
+typedef struct QTNodeStats {
+    QTNode *node;           // NULL for an empty slot
+    uint64_t sum;
+    uint64_t sum_sq;
+} QTNodeStats;
+
+struct QTArena {
+    QTSlab *slabs;          // Every slab of the tree, newest first
+    pthread_mutex_t lock;   // Guards slabs while several threads allocate
+    QTNode **free_nodes;    // Released nodes, handed out again first
+    size_t free_count;
+    size_t free_capacity;
+    QTNodeStats *stats;     // Open-addressing table by node address, or NULL
+    size_t stats_count;
+    size_t stats_mask;
+};
+
+// Bump allocator over an arena. Each thread building part of a tree uses its
+// own cursor, so the nodes of one recursive build come out in preorder.
+typedef struct QTArenaCursor {
+    QTArena *arena;
+    QTSlab *slab;
+    unsigned int next_shift;
+} QTArenaCursor;
+
+// Position of a cursor, for dropping every node it handed out afterwards.
+typedef struct QTArenaMark {
+    QTSlab *slab;
+    size_t used;
+    QTSlab *newest;         // The arena's newest slab at the time
+    size_t free_count;
+} QTArenaMark;
+
+// Open-addressing index of a DAG's nodes by content, for hash-consing.
+typedef struct QTDagTable {
+    uint32_t *slots;        // Node index + 1, or 0 when empty
+    size_t mask;            // Slot count - 1, a power of two minus one
+} QTDagTable;
+
+// Kinds of node in the DAG file format.
+#define QT_DAG_LEAF 0
+#define QT_DAG_SPLIT 1      // Internal node written in full
+#define QT_DAG_REF 2        // Internal node written before
+
+// The DAG file format: the magic, width and height as in the binary preorder
+// format, then the expanded tree in preorder, except that an internal node
+// met again is written as a reference to its first occurrence and its
+// subtree skipped, provided its region has the same size as there. Internal
+// nodes written in full are numbered from 0 in order. Nodes come in groups
+// of four: a byte of 2-bit kinds (bits 2k and 2k + 1 for the k-th node),
+// then each node's intensity, or for a reference the number it refers to as
+// a LEB128 varint.
+// An internal node written in full and the size of its region. The subtree
+// only fits regions of that size, so references elsewhere are not made.
+typedef struct QTDagNumbered {
+    uint32_t value;         // The writer's number, or the reader's DAG index
+    unsigned int height;
+    unsigned int width;
+} QTDagNumbered;
+
+typedef struct QTDagWriter {
+    FILE *fp;
+    unsigned char kinds;
+    unsigned char payload[4 * 5];
+    int size;
+    int count;
+    QTDagNumbered *numbers; // Per DAG node, its number once written in full
+    uint32_t next_number;
+} QTDagWriter;
+
+typedef struct QTDagReader {
+    FILE *fp;
+    unsigned char kinds;
+    int index;              // Position of the next node in its group
+    QTDag *dag;
+    QTDagNumbered *nodes;   // DAG index of each number, QT_DAG_NONE until read
+    size_t count;
+    size_t capacity;
+    QTDagTable table;
+} QTDagReader;
+
+// Operations of the sequence format, one per node of a frame's tree in
+// preorder, compared with the node at the same place in the previous frame.
+#define QT_DELTA_KEEP 0         // Subtree unchanged, nothing more is written
+#define QT_DELTA_LEAF 1         // Leaf, then its intensity
+#define QT_DELTA_SPLIT 2        // Internal node, then its intensity
+#define QT_DELTA_SPLIT_SAME 3   // Internal node with the previous intensity
+
+// The sequence format: the magic, width and height as in the binary preorder
+// format, then every frame's operations in groups of four. A group is a byte
+// of 2-bit operations (bits 2k and 2k + 1 for the k-th node) followed by the
+// intensities the operations call for. Each frame starts a new group.
+struct QTSequenceWriter {
+    FILE *fp;
+    QTLinearTree *previous;     // Last frame written, or NULL before the first
+    unsigned char ops;
+    unsigned char payload[4];
+    int size;
+    int count;
+};
+
+struct QTSequenceReader {
+    FILE *fp;
+    unsigned int width;
+    unsigned int height;
+    QTLinearTree *previous;     // Frame returned last
+    QTLinearTree *current;      // Frame being decoded
+    unsigned char ops;
+    int index;                  // Position of the next node in its group
+};
+
+// Summed-area tables over an image's pixels and squared pixels. Entry
+// (r, c) holds the total over rows [0, r) and columns [0, c), so the sum of
+// any rectangle takes four lookups. Totals are exact 64-bit integers.
+typedef struct IntegralImage {
+    Image *image;
+    uint64_t *sum;
+    uint64_t *sum_sq;
+    unsigned int stride;    // Image width + 1
+} IntegralImage;
+
+// Read-only window onto 8-bit pixels, either a loaded Image or a mapped file.
+// Pixel (r, c) is data[r * row_stride + c * step], unless tiles_across is set
+// and the pixels are in the IMAGE_TILED layout.
+typedef struct QTPixels {
+    const unsigned char *data;
+    size_t row_stride;
+    unsigned int step;
+    size_t tiles_across;    // Blocks per block row of an IMAGE_TILED image, or 0
+} QTPixels;
+
+// Products of region sums, up to 2^96 for the largest images load_image
+// accepts. Compilers without a 128-bit integer form them in 64-bit halves.
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 QTWide;
+#endif
+
+// A rectangle of the image, in the same terms as the QTNode geometry fields.
+typedef struct QTRegion {
+    unsigned int row;
+    unsigned int col;
+    unsigned int height;
+    unsigned int width;
+} QTRegion;
+
+// Shared state of one create_quadtree_parallel call. cursors has one entry
+// per pool worker plus a last one for the calling thread.
+typedef struct ParallelBuild {
+    IntegralImage *integral;
+    double max_rmse;
+    ThreadPool *pool;
+    QTArenaCursor *cursors;
+} ParallelBuild;
+
+// Shared state of one create_quadtree_bottom_up call.
+typedef struct BottomUpBuild {
+    QTPixels pixels;
+    double max_rmse;
+    QTArenaCursor *cursor;
+} BottomUpBuild;
+
+// Shared state of one qtree_update call. Leaves that must change are
+// rebuilt with the bottom-up builder on the tree's own arena.
+typedef struct QTUpdate {
+    BottomUpBuild build;
+    QTRegion dirty;
+    QTArena *arena;
+} QTUpdate;
+
+// Totals of one region above the tiles of a tiled build, kept in preorder.
+typedef struct QTTileStats {
+    uint64_t sum;
+    uint64_t sum_sq;
+    size_t subtree;         // Entries in the region's subtree, itself included
+} QTTileStats;
+
+// Shared state of one create_quadtree_tiled call.
+typedef struct TiledBuild {
+    QTPixels pixels;        // The mapped file
+    double max_rmse;
+    uint64_t tile_pixels;
+    QTTileStats *stats;
+    size_t count;
+    size_t capacity;
+    QTArenaCursor *cursor;
+} TiledBuild;
+
+// A subtree handed to the pool; the result is stored through slot.
+typedef struct SubtreeTask {
+    ParallelBuild *build;
+    QTRegion region;
+    QTNode **slot;
+} SubtreeTask;
+
+// A band of rows or columns of an integral image, filled by one pool task.
+typedef struct IntegralBandTask {
+    IntegralImage *integral;
+    unsigned int first;
+    unsigned int last;
+    int columns;
+} IntegralBandTask;
+
+// Compact binary preorder format: the magic, the root width and height as
+// little-endian 32-bit values, then the nodes in preorder in groups of
+// eight. A group is one byte of split flags (bit k for its k-th node) and
+// then the intensity of each of its nodes. Node geometry is not stored; it
+// follows from the root size and split_region.
+typedef struct QTBinaryWriter {
+    FILE *fp;
+    unsigned char flags;
+    unsigned char intensities[8];
+    int count;
+} QTBinaryWriter;
+
+typedef struct QTBinaryReader {
+    FILE *fp;
+    unsigned char flags;
+    int index;              // Position of the next node in its group
+} QTBinaryReader;
+
+// Leaf waiting in the max-heap of create_quadtree_budget, keyed on its
+// squared error. Equal errors go to the leaf queued first.
+typedef struct QTBudgetEntry {
+    double error;
+    uint64_t order;
+    QTNode *node;
+} QTBudgetEntry;
+
+typedef struct QTBudgetHeap {
+    QTBudgetEntry *entries;
+    size_t count;
+    size_t capacity;
+    uint64_t next_order;
+} QTBudgetHeap;
+
+// Rows [first_row, last_row) of a qtree_render_parallel call.
+typedef struct QTRenderBand {
+    QTNode *root;
+    unsigned char *pixels;
+    size_t stride;
+    unsigned int first_row;
+    unsigned int last_row;
+} QTRenderBand;
+
+// Output raster and scale of one qtree_render_lod call.
+typedef struct QTLodTarget {
+    unsigned char *pixels;
+    unsigned int width;
+    unsigned int height;
+    unsigned int source_width;
+    unsigned int source_height;
+    unsigned int max_depth;
+} QTLodTarget;
+
+// Output of encode_preorder_qt and encode_preorder_qt_binary; binary is NULL
+// when writing the text format.
+typedef struct QTStreamEncoder {
+    IntegralImage *integral;
+    double max_rmse;
+    FILE *fp;
+    QTBinaryWriter *binary;
+} QTStreamEncoder;
+
+// Output raster of render_preorder_qt.
+typedef struct QTRaster {
+    unsigned char *pixels;
+    unsigned int width;
+    unsigned int height;
+} QTRaster;
+
+// Adaptive model of the entropy-coded format. Split flags are coded in
+// preorder in the context of the node's depth and of how many earlier
+// siblings split; pixels that cannot split have no flag. Intensities follow
+// in postorder. A leaf is coded as its difference (modulo 256) from a
+// prediction made from siblings already coded: child1 inherits its parent's
+// prediction, child2 and child3 use child1, and child4 the median predictor
+// of its three siblings. Leaf statistics are kept per leaf size class. An
+// internal node is coded against the area-weighted mean of its children,
+// which it almost always equals.
+typedef struct QTCodedModel {
+    RCProb split[QT_CODED_DEPTHS][4];
+    RCProb leaf_residual[QT_CODED_SIZE_CLASSES][256];
+    RCProb node_residual[256];
+} QTCodedModel;
+
+// Adaptive model of the residual layer of the lossless format. Residuals are
+// (pixel - rendered tree) modulo 256, read as signed and zigzag mapped to
+// 0, -1, 1, -2, ... so small magnitudes get small symbols.
+typedef struct QTResidualModel {
+    RCProb residual[QT_RESIDUAL_CONTEXTS][256];
+} QTResidualModel;
 
 // Forward declarations
-static double calculate_rmse(Image *image, unsigned int start_row, 
-                           unsigned int start_col, unsigned int height,
-                           unsigned int width, double avg_intensity);
-                           
-static double calculate_average_intensity(Image *image, unsigned int start_row,
-                                       unsigned int start_col, unsigned int height,
-                                       unsigned int width);
-                                       
-static QTNode *create_node(Image *image, unsigned int row, unsigned int col,
-                          unsigned int height, unsigned int width, double max_rmse);
+static QTArena *arena_create(void);
+
+static QTArena *arena_of_node(QTNode *node);
+
+static int arena_release_node(QTArena *arena, QTNode *node);
+
+static void arena_release_subtree(QTArena *arena, QTNode *node);
+
+static size_t count_arena_nodes(QTArena *arena, QTNode *node);
+
+static size_t arena_live_nodes(QTArena *arena);
+
+static void arena_destroy(QTArena *arena);
+
+static void arena_cursor_init(QTArenaCursor *cursor, QTArena *arena);
+
+static QTNode *arena_alloc_node(QTArenaCursor *cursor);
+
+static QTArenaMark arena_mark(QTArenaCursor *cursor);
+
+static void arena_rewind(QTArenaCursor *cursor, QTArenaMark mark);
+
+static int alloc_integral_image(Image *image, IntegralImage *integral);
+
+static void integral_row_prefixes(IntegralImage *integral, unsigned int first_row,
+                                  unsigned int last_row);
+
+static void integral_column_totals(IntegralImage *integral, unsigned int first_col,
+                                   unsigned int last_col);
+
+static int build_integral_image(Image *image, IntegralImage *integral);
+
+static void integral_band_task(void *arg);
+
+static int build_integral_image_parallel(Image *image, IntegralImage *integral,
+                                         ThreadPool *pool);
+
+static void free_integral_image(IntegralImage *integral);
+
+static void region_sums(IntegralImage *integral, unsigned int start_row,
+                        unsigned int start_col, unsigned int height,
+                        unsigned int width, uint64_t *sum, uint64_t *sum_sq);
+
+static double squared_deviation(uint64_t count, uint64_t sum, uint64_t sum_sq);
+
+static double calculate_rmse(uint64_t count, uint64_t sum, uint64_t sum_sq);
+
+static QTPixels image_pixels(Image *image);
+
+static const unsigned char *pixel_run(QTPixels pixels, unsigned int row, unsigned int col,
+                                      unsigned int *run);
+
+static double scan_rmse(QTPixels pixels, unsigned int start_row,
+                        unsigned int start_col, unsigned int height,
+                        unsigned int width, double avg_intensity);
+
+static int exceeds_max_rmse(QTPixels pixels, unsigned int row,
+                            unsigned int col, unsigned int height,
+                            unsigned int width, double avg, double rmse,
+                            double max_rmse);
+
+static void split_region(QTRegion region, QTRegion children[4]);
+
+static unsigned char measure_sums(QTPixels pixels, QTRegion region, uint64_t sum,
+                                  uint64_t sum_sq, double max_rmse, int *split);
+
+static unsigned char measure_region(IntegralImage *integral, QTRegion region,
+                                    double max_rmse, int *split);
+
+static QTNode *init_node(IntegralImage *integral, QTArenaCursor *cursor,
+                         QTRegion region, double max_rmse, int *split);
+
+static QTNode *create_node(IntegralImage *integral, QTArenaCursor *cursor,
+                           QTRegion region, double max_rmse);
+
+static void build_subtree_task(void *arg);
+
+static int budget_entry_before(QTBudgetEntry *a, QTBudgetEntry *b);
+
+static int budget_heap_push(QTBudgetHeap *heap, QTNode *node, double error);
+
+static QTBudgetEntry budget_heap_pop(QTBudgetHeap *heap);
+
+static QTNode *create_budget_leaf(IntegralImage *integral, QTArenaCursor *cursor,
+                                  QTRegion region, QTBudgetHeap *heap);
+
+static QTNode *create_node_parallel(ParallelBuild *build, QTRegion region);
+
+static QTNode *create_node_bottom_up(BottomUpBuild *build, QTRegion region, uint64_t *sum,
+                                     uint64_t *sum_sq);
+
+static int stats_lookup(QTArena *arena, QTNode *node, uint64_t *sum, uint64_t *sum_sq);
+
+static int stats_store(QTArena *arena, QTNode *node, uint64_t sum, uint64_t sum_sq);
+
+static size_t stats_slot(QTArena *arena, QTNode *node);
+
+static size_t stats_home(QTArena *arena, QTNode *node);
+
+static void stats_erase(QTArena *arena, QTNode *node);
+
+static int regions_overlap(QTRegion a, QTRegion b);
+
+static int update_node(QTUpdate *update, QTNode *node, uint64_t *sum, uint64_t *sum_sq);
+
+static size_t tiled_stats(TiledBuild *build, QTRegion region, int *ok);
+
+static void offset_subtree(QTNode *node, unsigned int row, unsigned int col);
+
+static QTNode *create_tile(TiledBuild *build, QTRegion region);
+
+static QTNode *create_tiled_node(TiledBuild *build, QTRegion region, size_t index);
                           
-static void fill_pixels_from_qtree(QTNode *node, unsigned char *pixels,
-                                 unsigned int image_width);
+static void fill_pixels_from_qtree(QTNode *node, unsigned char *pixels, size_t stride,
+                                   unsigned int width, unsigned int first_row,
+                                   unsigned int last_row);
+
+static void render_band_task(void *arg);
+
+static int node_contains(QTNode *node, unsigned int row, unsigned int col);
+
+static QTNode *child_containing(QTNode *node, unsigned int row, unsigned int col);
+
+static void render_region_recursive(QTNode *node, QTRegion view, unsigned char *buf);
+
+static unsigned int first_output_index(uint64_t source_start, unsigned int source_size,
+                                       unsigned int output_size);
+
+static void render_lod_recursive(QTNode *node, QTLodTarget *target, unsigned int depth);
                                  
 static void save_preorder_qt_recursive(QTNode *node, FILE *fp);
 
-static QTNode *load_preorder_qt_recursive(FILE *fp);
+static QTNode *load_preorder_qt_recursive(FILE *fp, QTArenaCursor *cursor);
+
+static void write_u32(FILE *fp, uint32_t value);
+
+static int read_u32(FILE *fp, uint32_t *value);
+
+static void binary_writer_put(QTBinaryWriter *writer, int split, unsigned char intensity);
+
+static void binary_writer_flush(QTBinaryWriter *writer);
+
+static int binary_reader_get(QTBinaryReader *reader, int *split, unsigned char *intensity);
+
+static int save_preorder_qt_binary_recursive(QTNode *node, QTRegion region,
+                                             QTBinaryWriter *writer);
+
+static QTNode *load_preorder_qt_binary_recursive(QTBinaryReader *reader, QTRegion region,
+                                                 QTArenaCursor *cursor);
+
+static void encode_preorder_node(QTStreamEncoder *encoder, QTRegion region);
+
+static int encode_preorder_file(Image *image, double max_rmse, char *filename, int binary);
+
+static int paint_leaf(QTRaster *raster, QTRegion region, unsigned char intensity);
+
+static int read_text_node(FILE *fp, char *type, unsigned char *intensity, QTRegion *region);
+
+static int render_text_node(FILE *fp, QTRaster *raster, char type, unsigned char intensity,
+                            QTRegion region, unsigned int depth);
+
+static int render_binary_node(QTBinaryReader *reader, QTRaster *raster, QTRegion region);
+
+static int render_preorder_qt_file(FILE *fp, QTRaster *raster);
+
+static void init_coded_model(QTCodedModel *model);
+
+static RCProb *coded_leaf_model(QTCodedModel *model, QTRegion region);
+
+static unsigned char predict_child(int index, int nchildren, const unsigned char *siblings,
+                                   unsigned char parent_prediction);
+
+static unsigned char children_mean(QTRegion *children, QTNode **nodes, QTRegion region);
+
+static int encode_coded_node(QTCodedModel *model, RangeEncoder *encoder, QTNode *node,
+                             QTRegion region, unsigned int depth,
+                             unsigned char prediction, int split_siblings);
+
+static QTNode *decode_coded_node(QTCodedModel *model, RangeDecoder *decoder,
+                                 QTArenaCursor *cursor, QTRegion region, unsigned int depth,
+                                 unsigned char prediction, int split_siblings);
+
+static unsigned char *read_file(char *filename, size_t *size);
+
+static int linear_append(QTLinearTree *tree, unsigned char intensity);
+
+static QTLinearTree *alloc_linear_tree(unsigned int width, unsigned int height);
+
+static void build_linear_node(QTLinearTree *tree, IntegralImage *integral,
+                              QTRegion region, double max_rmse, int *ok);
+
+static int linear_from_node(QTLinearTree *tree, QTNode *node, QTRegion region);
+
+static QTNode *node_from_linear(QTLinearTree *tree, size_t index, QTRegion region,
+                                QTArenaCursor *cursor);
+
+static QTLinearNode get_linear_child(QTLinearTree *tree, QTLinearNode node, int which);
+
+static void build_multi_node(QTMultiTree *multi, IntegralImage *integral, QTRegion region,
+                             int *ok);
+
+static int multi_splits(QTMultiTree *multi, size_t index, QTRegion region, double max_rmse);
+
+static int extract_linear_node(QTMultiTree *multi, QTLinearTree *tree, size_t index,
+                               QTRegion region, double max_rmse);
+
+static unsigned int residual_magnitude(unsigned char residual);
+
+static unsigned int residual_context(const unsigned char *row, const unsigned char *above,
+                                     unsigned int col);
+
+static unsigned char predict_residual(const unsigned char *row, const unsigned char *above,
+                                      unsigned int col);
+
+static unsigned int zigzag_residual(unsigned char residual);
+
+static unsigned char unzigzag_residual(unsigned int symbol);
+
+static Image *decode_lossless(char *filename, QTNode **base);
+
+static int linear_append_range(QTLinearTree *tree, QTLinearTree *source, size_t first,
+                               size_t count);
+
+static int linear_subtree_equal(QTLinearTree *a, size_t a_index, QTLinearTree *b,
+                                size_t b_index);
+
+static void delta_put(QTSequenceWriter *writer, int op, int has_intensity,
+                      unsigned char intensity);
+
+static void delta_flush(QTSequenceWriter *writer);
+
+static int delta_get(QTSequenceReader *reader, int *op, unsigned char *intensity);
+
+static void write_delta_node(QTSequenceWriter *writer, QTLinearTree *tree, size_t index,
+                             size_t previous, QTRegion region);
+
+static int read_delta_node(QTSequenceReader *reader, size_t previous, QTRegion region);
+
+static size_t dag_hash(const QTDagNode *node);
+
+static int dag_same_node(const QTDagNode *a, const QTDagNode *b);
+
+static int dag_table_grow(QTDag *dag, QTDagTable *table);
+
+static uint32_t dag_intern(QTDag *dag, QTDagTable *table, QTDagNode node);
+
+static int dag_append(QTDag *dag, QTDagNode node);
+
+static int dag_from_node(QTDag *dag, QTDagTable *table, QTNode *node, QTRegion region,
+                         uint32_t *index);
+
+static int dag_children(QTDag *dag, uint32_t index, QTRegion region, QTRegion children[4]);
+
+static QTNode *node_from_dag(QTDag *dag, uint32_t index, QTRegion region,
+                             QTArenaCursor *cursor);
+
+static int render_dag_node(QTDag *dag, uint32_t index, QTRegion region, QTRaster *raster);
+
+static int read_varint(FILE *fp, uint32_t *value);
+
+static void dag_writer_put(QTDagWriter *writer, int kind, uint32_t payload);
+
+static void dag_writer_flush(QTDagWriter *writer);
+
+static int dag_reader_get(QTDagReader *reader, int *kind, uint32_t *payload);
+
+static int save_dag_node(QTDag *dag, uint32_t index, QTRegion region, QTDagWriter *writer);
+
+static int load_dag_node(QTDagReader *reader, QTRegion region, uint32_t *index);
+
+// Arena holding node, or NULL for a node allocated on its own.
+static QTArena *arena_of_node(QTNode *node) {
+    if (node->slab_shift == 0) return NULL;
+    uintptr_t mask = ((uintptr_t)1 << node->slab_shift) - 1;
+    return ((QTSlab *)((uintptr_t)node & ~mask))->arena;
+}
+
+static QTArena *arena_create(void) {
+    QTArena *arena = malloc(sizeof(QTArena));
+    if (!arena) return NULL;
+
+    arena->slabs = NULL;
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->free_nodes = NULL;
+    arena->free_count = arena->free_capacity = 0;
+    arena->stats = NULL;
+    arena->stats_count = arena->stats_mask = 0;
+    return arena;
+}
+
+static void arena_destroy(QTArena *arena) {
+    if (!arena) return;
+
+    QTSlab *slab = arena->slabs;
+    while (slab) {
+        QTSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    pthread_mutex_destroy(&arena->lock);
+    free(arena->free_nodes);
+    free(arena->stats);
+    free(arena);
+}
+
+static void arena_cursor_init(QTArenaCursor *cursor, QTArena *arena) {
+    cursor->arena = arena;
+    cursor->slab = NULL;
+    cursor->next_shift = ARENA_FIRST_SLAB_SHIFT;
+}
+
+// Returns a node whose fields other than slab_shift are uninitialized, or
+// NULL when out of memory. Released nodes are handed out again first.
+static QTNode *arena_alloc_node(QTArenaCursor *cursor) {
+    QTArena *arena = cursor->arena;
+    if (arena->free_count > 0) return arena->free_nodes[--arena->free_count];
+
+    QTSlab *slab = cursor->slab;
+    if (slab && slab->used < slab->capacity) return &slab->nodes[slab->used++];
+
+    size_t size = (size_t)1 << cursor->next_shift;
+    slab = aligned_alloc(size, size);
+    if (!slab) return NULL;
+    slab->arena = arena;
+    slab->used = 1;
+    slab->capacity = (size - sizeof(QTSlab)) / sizeof(QTNode);
+    for (size_t i = 0; i < slab->capacity; i++) {
+        slab->nodes[i].slab_shift = (unsigned char)cursor->next_shift;
+    }
+    if (cursor->next_shift < ARENA_MAX_SLAB_SHIFT) cursor->next_shift++;
+
+    pthread_mutex_lock(&cursor->arena->lock);
+    slab->next = cursor->arena->slabs;
+    cursor->arena->slabs = slab;
+    pthread_mutex_unlock(&cursor->arena->lock);
+
+    cursor->slab = slab;
+    return &slab->nodes[0];
+}
+
+static QTArenaMark arena_mark(QTArenaCursor *cursor) {
+    QTArenaMark mark = {cursor->slab, cursor->slab ? cursor->slab->used : 0,
+                        cursor->arena->slabs, cursor->arena->free_count};
+    return mark;
+}
+
+// Frees every node allocated through cursor since mark. Only valid while the
+// cursor is the arena's sole allocator and nothing is released meanwhile, so
+// that the slabs it opened since are the newest in the arena and the free
+// nodes it took are still stored past the end of the free list.
+static void arena_rewind(QTArenaCursor *cursor, QTArenaMark mark) {
+    QTArena *arena = cursor->arena;
+    while (arena->slabs != mark.newest) {
+        QTSlab *next = arena->slabs->next;
+        free(arena->slabs);
+        arena->slabs = next;
+    }
+    if (mark.slab) mark.slab->used = mark.used;
+    cursor->slab = mark.slab;
+    arena->free_count = mark.free_count;
+}
+
+// Puts node on the arena's free list and drops its cached totals. Out of
+// memory, the node just stays allocated until the arena goes.
+static int arena_release_node(QTArena *arena, QTNode *node) {
+    if (arena->free_count == arena->free_capacity) {
+        size_t capacity = arena->free_capacity ? arena->free_capacity * 2 : 64;
+        QTNode **nodes = realloc(arena->free_nodes, capacity * sizeof(QTNode *));
+        if (!nodes) return 0;
+        arena->free_nodes = nodes;
+        arena->free_capacity = capacity;
+    }
+    arena->free_nodes[arena->free_count++] = node;
+    if (arena->stats) stats_erase(arena, node);
+    return 1;
+}
+
+// Releases node's subtree into arena. Descendants allocated elsewhere are
+// handed to delete_quadtree, which frees them where they belong.
+static void arena_release_subtree(QTArena *arena, QTNode *node) {
+    if (!node) return;
+    QTNode *children[4] = {node->child1, node->child2, node->child3, node->child4};
+    for (int k = 0; k < 4; k++) {
+        if (!children[k]) continue;
+        if (arena_of_node(children[k]) == arena) arena_release_subtree(arena, children[k]);
+        else delete_quadtree(children[k]);
+    }
+    arena_release_node(arena, node);
+}
+
+// Nodes in node's subtree, or SIZE_MAX if any of them is not from arena.
+static size_t count_arena_nodes(QTArena *arena, QTNode *node) {
+    if (arena_of_node(node) != arena) return SIZE_MAX;
+
+    size_t count = 1;
+    QTNode *children[4] = {node->child1, node->child2, node->child3, node->child4};
+    for (int k = 0; k < 4; k++) {
+        if (!children[k]) continue;
+        size_t below = count_arena_nodes(arena, children[k]);
+        if (below == SIZE_MAX) return SIZE_MAX;
+        count += below;
+    }
+    return count;
+}
+
+// Nodes the arena has handed out and not taken back.
+static size_t arena_live_nodes(QTArena *arena) {
+    size_t used = 0;
+    for (QTSlab *slab = arena->slabs; slab; slab = slab->next) used += slab->used;
+    return used - arena->free_count;
+}
+
+static int alloc_integral_image(Image *image, IntegralImage *integral) {
+    unsigned int width = get_image_width(image);
+    unsigned int height = get_image_height(image);
+    size_t entries = (size_t)(width + 1) * (height + 1);
+
+    integral->image = image;
+    integral->stride = width + 1;
+    integral->sum = calloc(entries, sizeof(uint64_t));
+    integral->sum_sq = calloc(entries, sizeof(uint64_t));
+    if (!integral->sum || !integral->sum_sq) {
+        free_integral_image(integral);
+        return 0;
+    }
+    return 1;
+}
+
+// First pass: table row i + 1 receives the running prefix of image row i.
+// Row 0 and column 0 stay zero.
+static void integral_row_prefixes(IntegralImage *integral, unsigned int first_row,
+                                  unsigned int last_row) {
+    unsigned int width = integral->stride - 1;
+    QTPixels pixels = image_pixels(integral->image);
+
+    for (unsigned int i = first_row; i < last_row; i++) {
+        uint64_t *sum_out = integral->sum + (size_t)(i + 1) * integral->stride;
+        uint64_t *sq_out = integral->sum_sq + (size_t)(i + 1) * integral->stride;
+        uint64_t row_sum = 0, row_sq = 0;
+
+        unsigned int j = 0;
+        while (j < width) {
+            unsigned int run;
+            const unsigned char *pixel = pixel_run(pixels, i, j, &run);
+            unsigned int stop = width - j < run ? width : j + run;
+            for (; j < stop; j++) {
+                uint64_t value = *pixel++;
+                row_sum += value;
+                row_sq += value * value;
+                sum_out[j + 1] = row_sum;
+                sq_out[j + 1] = row_sq;
+            }
+        }
+    }
+}
+
+// Second pass: accumulate table columns [first_col, last_col) downwards.
+static void integral_column_totals(IntegralImage *integral, unsigned int first_col,
+                                   unsigned int last_col) {
+    unsigned int height = get_image_height(integral->image);
+
+    for (unsigned int i = 1; i <= height; i++) {
+        uint64_t *sum_row = integral->sum + (size_t)i * integral->stride;
+        uint64_t *sq_row = integral->sum_sq + (size_t)i * integral->stride;
+        const uint64_t *sum_above = sum_row - integral->stride;
+        const uint64_t *sq_above = sq_row - integral->stride;
+
+        for (unsigned int j = first_col; j < last_col; j++) {
+            sum_row[j] += sum_above[j];
+            sq_row[j] += sq_above[j];
+        }
+    }
+}
+
+static int build_integral_image(Image *image, IntegralImage *integral) {
+    if (!alloc_integral_image(image, integral)) return 0;
+
+    integral_row_prefixes(integral, 0, get_image_height(image));
+    integral_column_totals(integral, 1, integral->stride);
+    return 1;
+}
+
+static void integral_band_task(void *arg) {
+    IntegralBandTask *band = arg;
+    if (band->columns) {
+        integral_column_totals(band->integral, band->first, band->last);
+    } else {
+        integral_row_prefixes(band->integral, band->first, band->last);
+    }
+}
+
+// Same table as build_integral_image with each pass split into bands. The row
+// pass must finish before any column band starts.
+static int build_integral_image_parallel(Image *image, IntegralImage *integral,
+                                         ThreadPool *pool) {
+    if (!alloc_integral_image(image, integral)) return 0;
+
+    unsigned int nbands = thread_pool_size(pool) * 4;
+    IntegralBandTask *bands = malloc(nbands * sizeof(IntegralBandTask));
+    if (!bands) {
+        integral_row_prefixes(integral, 0, get_image_height(image));
+        integral_column_totals(integral, 1, integral->stride);
+        return 1;
+    }
+
+    for (int columns = 0; columns <= 1; columns++) {
+        unsigned int start = columns ? 1 : 0;
+        unsigned int end = columns ? integral->stride : get_image_height(image);
+        unsigned int span = end - start;
+
+        for (unsigned int b = 0; b < nbands; b++) {
+            bands[b].integral = integral;
+            bands[b].first = start + (unsigned int)((uint64_t)span * b / nbands);
+            bands[b].last = start + (unsigned int)((uint64_t)span * (b + 1) / nbands);
+            bands[b].columns = columns;
+            if (!thread_pool_submit(pool, integral_band_task, &bands[b])) {
+                integral_band_task(&bands[b]);
+            }
+        }
+        thread_pool_wait(pool);
+    }
+
+    free(bands);
+    return 1;
+}
+
+static void free_integral_image(IntegralImage *integral) {
+    free(integral->sum);
+    free(integral->sum_sq);
+    integral->sum = integral->sum_sq = NULL;
+}
+
+static void region_sums(IntegralImage *integral, unsigned int start_row,
+                        unsigned int start_col, unsigned int height,
+                        unsigned int width, uint64_t *sum, uint64_t *sum_sq) {
+    size_t top = (size_t)start_row * integral->stride;
+    size_t bottom = (size_t)(start_row + height) * integral->stride;
+    unsigned int left = start_col;
+    unsigned int right = start_col + width;
+
+    *sum = integral->sum[bottom + right] - integral->sum[bottom + left]
+         - integral->sum[top + right] + integral->sum[top + left];
+    *sum_sq = integral->sum_sq[bottom + right] - integral->sum_sq[bottom + left]
+            - integral->sum_sq[top + right] + integral->sum_sq[top + left];
+}
+
+#if !defined(__SIZEOF_INT128__)
+// Full 128-bit product of a and b, from four 32-bit partial products.
+static void multiply_wide(uint64_t a, uint64_t b, uint64_t *high, uint64_t *low) {
+    uint64_t a_low = a & 0xFFFFFFFFu, a_high = a >> 32;
+    uint64_t b_low = b & 0xFFFFFFFFu, b_high = b >> 32;
+    uint64_t low_low = a_low * b_low;
+    uint64_t high_low = a_high * b_low;
+    uint64_t low_high = a_low * b_high;
+    uint64_t middle = (low_low >> 32) + (high_low & 0xFFFFFFFFu) + (low_high & 0xFFFFFFFFu);
+
+    *low = (middle << 32) | (low_low & 0xFFFFFFFFu);
+    *high = a_high * b_high + (high_low >> 32) + (low_high >> 32) + (middle >> 32);
+}
+#endif
+
+// n * sum_sq - sum^2, which is n times the squared error of the region and
+// never negative. Computed exactly, so it is 0 only for uniform regions.
+static double squared_deviation(uint64_t count, uint64_t sum, uint64_t sum_sq) {
+#if defined(__SIZEOF_INT128__)
+    return (double)((QTWide)count * sum_sq - (QTWide)sum * sum);
+#else
+    uint64_t count_high, count_low, sum_high, sum_low;
+    multiply_wide(count, sum_sq, &count_high, &count_low);
+    multiply_wide(sum, sum, &sum_high, &sum_low);
+    uint64_t high = count_high - sum_high - (count_low < sum_low);
+    return ldexp((double)high, 64) + (double)(count_low - sum_low);
+#endif
+}
+
+// Root of the mean squared deviation, sum((x - mean)^2) / n, evaluated as
+// (n * sum_sq - sum^2) / n^2 so the numerator is exact.
+static double calculate_rmse(uint64_t count, uint64_t sum, uint64_t sum_sq) {
+    if (count == 0) return 0.0;
+
+    double n = (double)count;
+    return sqrt(squared_deviation(count, sum, sum_sq) / (n * n));
+}
+
+static QTPixels image_pixels(Image *image) {
+    QTPixels pixels = {image->pixels, get_image_width(image), 1, 0};
+    if (image->layout == IMAGE_TILED) {
+        pixels.tiles_across = (get_image_width(image) + IMAGE_TILE_SIDE - 1) / IMAGE_TILE_SIDE;
+    }
+    return pixels;
+}
+
+// Address of pixel (row, col). The next *run pixels of the row, at most,
+// follow it step bytes apart; that is the rest of the row unless the pixels
+// are tiled.
+static const unsigned char *pixel_run(QTPixels pixels, unsigned int row, unsigned int col,
+                                      unsigned int *run) {
+    if (!pixels.tiles_across) {
+        *run = UINT_MAX;
+        return pixels.data + (size_t)row * pixels.row_stride + (size_t)col * pixels.step;
+    }
+    size_t block = (size_t)(row / IMAGE_TILE_SIDE) * pixels.tiles_across + col / IMAGE_TILE_SIDE;
+    *run = IMAGE_TILE_SIDE - col % IMAGE_TILE_SIDE;
+    return pixels.data + (block * IMAGE_TILE_SIDE + row % IMAGE_TILE_SIDE) * IMAGE_TILE_SIDE
+         + col % IMAGE_TILE_SIDE;
+}
+
+// Direct double-precision pass over the region. This is the reference
+// definition of a node's RMSE; the rounding it accumulates decides ties.
+static double scan_rmse(QTPixels pixels, unsigned int start_row,
+                        unsigned int start_col, unsigned int height,
+                        unsigned int width, double avg_intensity) {
+    double sum_squared_diff = 0.0;
+
+    for (unsigned int i = start_row; i < start_row + height; i++) {
+        unsigned int j = start_col, end = start_col + width;
+        while (j < end) {
+            unsigned int run;
+            const unsigned char *pixel = pixel_run(pixels, i, j, &run);
+            unsigned int stop = end - j < run ? end : j + run;
+            for (; j < stop; j++, pixel += pixels.step) {
+                double diff = *pixel - avg_intensity;
+                sum_squared_diff += diff * diff;
+            }
+        }
+    }
+
+    return sqrt(sum_squared_diff / ((double)height * width));
+}
+
+// The split test. The exact RMSE settles it unless it is within rounding
+// distance of the threshold, where the reference scan is rerun so trees stay
+// identical to those built by scanning every node.
+static int exceeds_max_rmse(QTPixels pixels, unsigned int row,
+                            unsigned int col, unsigned int height,
+                            unsigned int width, double avg, double rmse,
+                            double max_rmse) {
+    if (fabs(rmse - max_rmse) > 1e-6 * max_rmse) return rmse > max_rmse;
+    if (max_rmse == 0.0) return 0;
+    return scan_rmse(pixels, row, col, height, width, avg) > max_rmse;
+}
+
+// Child rectangles of a split region, in child1..child4 order. Rows and
+// columns are halved, the second half taking any odd remainder; a dimension
+// of 1 is not split, so single rows only get child1/child2 and single columns
+// child1/child3. Absent children are left with zero height and width.
+static void split_region(QTRegion region, QTRegion children[4]) {
+    unsigned int half_height = region.height / 2;
+    unsigned int half_width = region.width / 2;
+
+    for (int k = 0; k < 4; k++) {
+        children[k].row = children[k].col = 0;
+        children[k].height = children[k].width = 0;
+    }
+    if (half_height == 0 && half_width == 0) return;
+
+    unsigned int top = half_height > 0 ? half_height : region.height;
+    unsigned int left = half_width > 0 ? half_width : region.width;
+
+    children[0] = (QTRegion){region.row, region.col, top, left};
+    if (half_width > 0) {
+        children[1] = (QTRegion){region.row, region.col + half_width,
+                                 top, region.width - half_width};
+    }
+    if (half_height > 0) {
+        children[2] = (QTRegion){region.row + half_height, region.col,
+                                 region.height - half_height, left};
+    }
+    if (half_height > 0 && half_width > 0) {
+        children[3] = (QTRegion){region.row + half_height, region.col + half_width,
+                                 region.height - half_height, region.width - half_width};
+    }
+}
+
+// Average intensity of a region with the given totals, and whether its RMSE
+// calls for children. pixels is only read to settle ties.
+static unsigned char measure_sums(QTPixels pixels, QTRegion region, uint64_t sum,
+                                  uint64_t sum_sq, double max_rmse, int *split) {
+    uint64_t count = (uint64_t)region.height * region.width;
+    double avg = (double)sum / (double)count;
+    double rmse = calculate_rmse(count, sum, sum_sq);
+    *split = exceeds_max_rmse(pixels, region.row, region.col, region.height,
+                              region.width, avg, rmse, max_rmse);
+    return (unsigned char)avg;  // Proper rounding
+}
+
+static unsigned char measure_region(IntegralImage *integral, QTRegion region,
+                                    double max_rmse, int *split) {
+    uint64_t sum, sum_sq;
+    region_sums(integral, region.row, region.col, region.height, region.width,
+                &sum, &sum_sq);
+    return measure_sums(image_pixels(integral->image), region, sum, sum_sq, max_rmse, split);
+}
+
+// Allocates a childless node for region with its average intensity and sets
+// *split when the region's RMSE calls for children.
+static QTNode *init_node(IntegralImage *integral, QTArenaCursor *cursor,
+                         QTRegion region, double max_rmse, int *split) {
+    *split = 0;
+    if (!integral || region.height == 0 || region.width == 0) return NULL;
+    
+    QTNode *node = arena_alloc_node(cursor);
+    if (!node) return NULL;
+    
+    node->row = region.row;
+    node->col = region.col;
+    node->height = region.height;
+    node->width = region.width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+    node->intensity = measure_region(integral, region, max_rmse, split);
+    return node;
+}
+
+static QTNode *create_node(IntegralImage *integral, QTArenaCursor *cursor,
+                           QTRegion region, double max_rmse) {
+    int split;
+    QTNode *node = init_node(integral, cursor, region, max_rmse, &split);
+    if (!node || !split) return node;
+
+    QTRegion children[4];
+    QTNode **slots[4] = {&node->child1, &node->child2, &node->child3, &node->child4};
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height > 0) {
+            *slots[k] = create_node(integral, cursor, children[k], max_rmse);
+        }
+    }
+    
+    return node;
+}
+
+static void build_subtree_task(void *arg) {
+    SubtreeTask *task = arg;
+    *task->slot = create_node_parallel(task->build, task->region);
+    free(task);
+}
+
+// create_node that hands child2..child4 of large regions to the pool and keeps
+// child1 for the current thread. Small regions fall through to create_node.
+static QTNode *create_node_parallel(ParallelBuild *build, QTRegion region) {
+    int worker = thread_pool_worker_index(build->pool);
+    QTArenaCursor *cursor = &build->cursors[worker >= 0 ? (unsigned int)worker
+                                            : thread_pool_size(build->pool)];
+
+    if ((uint64_t)region.height * region.width < PARALLEL_MIN_REGION) {
+        return create_node(build->integral, cursor, region, build->max_rmse);
+    }
+
+    int split;
+    QTNode *node = init_node(build->integral, cursor, region, build->max_rmse, &split);
+    if (!node || !split) return node;
+
+    QTRegion children[4];
+    QTNode **slots[4] = {&node->child1, &node->child2, &node->child3, &node->child4};
+    split_region(region, children);
+    for (int k = 1; k < 4; k++) {
+        if (children[k].height == 0) continue;
+
+        SubtreeTask *task = malloc(sizeof(SubtreeTask));
+        if (task) {
+            task->build = build;
+            task->region = children[k];
+            task->slot = slots[k];
+            if (thread_pool_submit(build->pool, build_subtree_task, task)) continue;
+            free(task);
+        }
+        *slots[k] = create_node_parallel(build, children[k]);
+    }
+    node->child1 = create_node_parallel(build, children[0]);
+
+    return node;
+}
+
+QTNode *create_quadtree(Image *image, double max_rmse) {
+    if (!image || max_rmse < 0) return NULL;
+
+    IntegralImage integral;
+    if (!build_integral_image(image, &integral)) return NULL;
+
+    QTArena *arena = arena_create();
+    if (!arena) {
+        free_integral_image(&integral);
+        return NULL;
+    }
+
+    QTArenaCursor cursor;
+    arena_cursor_init(&cursor, arena);
+    QTRegion whole = {0, 0, get_image_height(image), get_image_width(image)};
+    QTNode *root = create_node(&integral, &cursor, whole, max_rmse);
+    free_integral_image(&integral);
+
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+// create_node in post-order: region's totals are merged from its children's,
+// down to blocks of 2x2 pixels, and the children are built first and dropped again
+// if region turns out not to split.
+static QTNode *create_node_bottom_up(BottomUpBuild *build, QTRegion region, uint64_t *sum,
+                                     uint64_t *sum_sq) {
+    QTNode *node = arena_alloc_node(build->cursor);
+    if (!node) return NULL;
+
+    node->row = region.row;
+    node->col = region.col;
+    node->height = region.height;
+    node->width = region.width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+
+    QTRegion children[4];
+    QTNode **slots[4] = {&node->child1, &node->child2, &node->child3, &node->child4};
+    split_region(region, children);
+    int split;
+
+    // Blocks of up to 2x2 are summed straight from their pixels and only get
+    // their single-pixel children once they are known to split.
+    if (region.height <= 2 && region.width <= 2) {
+        *sum = *sum_sq = 0;
+        for (unsigned int i = region.row; i < region.row + region.height; i++) {
+            for (unsigned int j = region.col; j < region.col + region.width; j++) {
+                unsigned int run;
+                uint64_t value = *pixel_run(build->pixels, i, j, &run);
+                *sum += value;
+                *sum_sq += value * value;
+            }
+        }
+        node->intensity = measure_sums(build->pixels, region, *sum, *sum_sq,
+                                       build->max_rmse, &split);
+        for (int k = 0; k < 4 && split; k++) {
+            if (children[k].height == 0) continue;
+
+            uint64_t child_sum, child_sum_sq;
+            *slots[k] = create_node_bottom_up(build, children[k], &child_sum, &child_sum_sq);
+            if (!*slots[k]) return NULL;
+        }
+        return node;
+    }
+
+    QTArenaMark mark = arena_mark(build->cursor);
+    *sum = *sum_sq = 0;
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+
+        uint64_t child_sum, child_sum_sq;
+        *slots[k] = create_node_bottom_up(build, children[k], &child_sum, &child_sum_sq);
+        if (!*slots[k]) return NULL;
+        *sum += child_sum;
+        *sum_sq += child_sum_sq;
+    }
+
+    node->intensity = measure_sums(build->pixels, region, *sum, *sum_sq, build->max_rmse,
+                                   &split);
+    if (!split) {
+        node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+        arena_rewind(build->cursor, mark);
+    }
+    return node;
+}
+
+QTNode *create_quadtree_bottom_up(Image *image, double max_rmse) {
+    if (!image || max_rmse < 0) return NULL;
+    if (get_image_width(image) == 0 || get_image_height(image) == 0) return NULL;
+
+    QTArena *arena = arena_create();
+    if (!arena) return NULL;
+
+    QTArenaCursor cursor;
+    arena_cursor_init(&cursor, arena);
+    BottomUpBuild build = {image_pixels(image), max_rmse, &cursor};
+    QTRegion whole = {0, 0, get_image_height(image), get_image_width(image)};
+    uint64_t sum, sum_sq;
+    QTNode *root = create_node_bottom_up(&build, whole, &sum, &sum_sq);
+
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+static size_t stats_home(QTArena *arena, QTNode *node) {
+    uint64_t hash = (uint64_t)(uintptr_t)node * 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash >> 32) & arena->stats_mask;
+}
+
+static size_t stats_slot(QTArena *arena, QTNode *node) {
+    size_t slot = stats_home(arena, node);
+    while (arena->stats[slot].node && arena->stats[slot].node != node) {
+        slot = (slot + 1) & arena->stats_mask;
+    }
+    return slot;
+}
+
+static int stats_lookup(QTArena *arena, QTNode *node, uint64_t *sum, uint64_t *sum_sq) {
+    if (!arena->stats) return 0;
+
+    QTNodeStats *entry = &arena->stats[stats_slot(arena, node)];
+    if (!entry->node) return 0;
+    *sum = entry->sum;
+    *sum_sq = entry->sum_sq;
+    return 1;
+}
+
+// Records node's totals, doubling the table once it is half full.
+static int stats_store(QTArena *arena, QTNode *node, uint64_t sum, uint64_t sum_sq) {
+    if (!arena->stats || arena->stats_count >= (arena->stats_mask + 1) / 2) {
+        size_t size = arena->stats ? (arena->stats_mask + 1) * 2 : 1024;
+        QTNodeStats *old = arena->stats;
+        size_t old_size = old ? arena->stats_mask + 1 : 0;
+        arena->stats = calloc(size, sizeof(QTNodeStats));
+        if (!arena->stats) {
+            arena->stats = old;
+            return 0;
+        }
+        arena->stats_mask = size - 1;
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].node) arena->stats[stats_slot(arena, old[i].node)] = old[i];
+        }
+        free(old);
+    }
+
+    QTNodeStats *entry = &arena->stats[stats_slot(arena, node)];
+    if (!entry->node) arena->stats_count++;
+    *entry = (QTNodeStats){node, sum, sum_sq};
+    return 1;
+}
+
+// Drops node's totals. Later entries of the same probe run move back into
+// the gap, so lookups never stop early there.
+static void stats_erase(QTArena *arena, QTNode *node) {
+    size_t gap = stats_slot(arena, node);
+    if (!arena->stats[gap].node) return;
+
+    arena->stats_count--;
+    size_t slot = gap;
+    for (;;) {
+        slot = (slot + 1) & arena->stats_mask;
+        QTNode *other = arena->stats[slot].node;
+        if (!other) break;
+        size_t home = stats_home(arena, other);
+        if (((slot - home) & arena->stats_mask) >= ((slot - gap) & arena->stats_mask)) {
+            arena->stats[gap] = arena->stats[slot];
+            gap = slot;
+        }
+    }
+    arena->stats[gap].node = NULL;
+}
+
+static int regions_overlap(QTRegion a, QTRegion b) {
+    return a.row < b.row + b.height && b.row < a.row + a.height &&
+           a.col < b.col + b.width && b.col < a.col + a.width;
+}
+
+// Brings node's subtree up to date in place and returns its totals. Nodes
+// clear of the dirty rectangle are kept as they are, with their totals
+// taken from the arena's cache or, the first time, from the pixels.
+static int update_node(QTUpdate *update, QTNode *node, uint64_t *sum, uint64_t *sum_sq) {
+    QTRegion region = {node->row, node->col, node->height, node->width};
+    if (!regions_overlap(region, update->dirty)) {
+        if (stats_lookup(update->arena, node, sum, sum_sq)) return 1;
+
+        *sum = *sum_sq = 0;
+        QTPixels pixels = update->build.pixels;
+        for (unsigned int i = region.row; i < region.row + region.height; i++) {
+            unsigned int j = region.col, end = region.col + region.width;
+            while (j < end) {
+                unsigned int run;
+                const unsigned char *pixel = pixel_run(pixels, i, j, &run);
+                unsigned int stop = end - j < run ? end : j + run;
+                for (; j < stop; j++) {
+                    uint64_t value = *pixel++;
+                    *sum += value;
+                    *sum_sq += value * value;
+                }
+            }
+        }
+        return stats_store(update->arena, node, *sum, *sum_sq);
+    }
+
+    QTNode *old[4] = {node->child1, node->child2, node->child3, node->child4};
+    if (!old[0] && !old[1] && !old[2] && !old[3]) {
+        QTNode *fresh = create_node_bottom_up(&update->build, region, sum, sum_sq);
+        if (!fresh) return 0;
+        node->intensity = fresh->intensity;
+        node->child1 = fresh->child1;
+        node->child2 = fresh->child2;
+        node->child3 = fresh->child3;
+        node->child4 = fresh->child4;
+        arena_release_node(update->arena, fresh);
+        return stats_store(update->arena, node, *sum, *sum_sq);
+    }
+
+    // The children's totals are needed whether or not the node still splits
+    QTRegion children[4];
+    split_region(region, children);
+    *sum = *sum_sq = 0;
+    for (int k = 0; k < 4; k++) {
+        if ((children[k].height > 0) != (old[k] != NULL)) return 0;
+        if (!old[k]) continue;
+
+        uint64_t child_sum, child_sum_sq;
+        if (!update_node(update, old[k], &child_sum, &child_sum_sq)) return 0;
+        *sum += child_sum;
+        *sum_sq += child_sum_sq;
+    }
+
+    int split;
+    node->intensity = measure_sums(update->build.pixels, region, *sum, *sum_sq,
+                                   update->build.max_rmse, &split);
+    if (!split) {
+        for (int k = 0; k < 4; k++) arena_release_subtree(update->arena, old[k]);
+        node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+    }
+    return stats_store(update->arena, node, *sum, *sum_sq);
+}
+
+int qtree_update(QTNode *root, Image *image, unsigned int row, unsigned int col,
+                 unsigned int height, unsigned int width, double max_rmse) {
+    QTArena *arena = root ? arena_of_node(root) : NULL;
+    if (!arena || !image || max_rmse < 0) return 0;
+    if (root->row != 0 || root->col != 0 || root->width != get_image_width(image) ||
+        root->height != get_image_height(image)) {
+        return 0;
+    }
+
+    // Clip the rectangle to the image so that its far edges cannot wrap
+    // around and make it look clear of the nodes it covers.
+    height = row < root->height ? (height < root->height - row ? height : root->height - row) : 0;
+    width = col < root->width ? (width < root->width - col ? width : root->width - col) : 0;
+
+    QTArenaCursor cursor;
+    arena_cursor_init(&cursor, arena);
+    QTUpdate update = {{image_pixels(image), max_rmse, &cursor},
+                       {row, col, height, width}, arena};
+    uint64_t sum, sum_sq;
+    return update_node(&update, root, &sum, &sum_sq);
+}
+
+// First pass of a tiled build: appends the totals of region and of every
+// region above the tiles below it, in preorder, and returns region's index.
+// Tiles are summed straight from the file.
+static size_t tiled_stats(TiledBuild *build, QTRegion region, int *ok) {
+    size_t index = build->count;
+    if (build->count == build->capacity) {
+        size_t capacity = build->capacity ? build->capacity * 2 : 64;
+        QTTileStats *stats = realloc(build->stats, capacity * sizeof(QTTileStats));
+        if (!stats) {
+            *ok = 0;
+            return index;
+        }
+        build->stats = stats;
+        build->capacity = capacity;
+    }
+    build->count++;
+
+    QTTileStats stats = {0, 0, 1};
+    if ((uint64_t)region.height * region.width <= build->tile_pixels) {
+        for (unsigned int i = region.row; i < region.row + region.height; i++) {
+            const unsigned char *row = build->pixels.data + (size_t)i * build->pixels.row_stride;
+            for (unsigned int j = region.col; j < region.col + region.width; j++) {
+                uint64_t value = row[(size_t)j * build->pixels.step];
+                stats.sum += value;
+                stats.sum_sq += value * value;
+            }
+        }
+    } else {
+        QTRegion children[4];
+        split_region(region, children);
+        for (int k = 0; k < 4; k++) {
+            if (children[k].height == 0) continue;
+            size_t child = tiled_stats(build, children[k], ok);
+            if (!*ok) return index;
+            stats.sum += build->stats[child].sum;
+            stats.sum_sq += build->stats[child].sum_sq;
+            stats.subtree += build->stats[child].subtree;
+        }
+    }
+    build->stats[index] = stats;
+    return index;
+}
+
+static void offset_subtree(QTNode *node, unsigned int row, unsigned int col) {
+    if (!node) return;
+    node->row += row;
+    node->col += col;
+    offset_subtree(node->child1, row, col);
+    offset_subtree(node->child2, row, col);
+    offset_subtree(node->child3, row, col);
+    offset_subtree(node->child4, row, col);
+}
+
+// Builds the subtree of a tile from an in-memory copy of its pixels, then
+// moves it from tile to image coordinates.
+static QTNode *create_tile(TiledBuild *build, QTRegion region) {
+    Image tile = {malloc((size_t)region.height * region.width), region.width, region.height,
+                  IMAGE_ROW_MAJOR};
+    if (!tile.pixels) return NULL;
+    for (unsigned int i = 0; i < region.height; i++) {
+        const unsigned char *row = build->pixels.data
+                                 + (size_t)(region.row + i) * build->pixels.row_stride
+                                 + (size_t)region.col * build->pixels.step;
+        unsigned char *out = tile.pixels + (size_t)i * region.width;
+        for (unsigned int j = 0; j < region.width; j++) out[j] = row[(size_t)j * build->pixels.step];
+    }
+
+    IntegralImage integral;
+    QTNode *node = NULL;
+    if (build_integral_image(&tile, &integral)) {
+        QTRegion local = {0, 0, region.height, region.width};
+        node = create_node(&integral, build->cursor, local, build->max_rmse);
+        free_integral_image(&integral);
+    }
+    free(tile.pixels);
+    offset_subtree(node, region.row, region.col);
+    return node;
+}
+
+// Second pass: create_node over the regions tiled_stats recorded, with
+// index naming region's entry.
+static QTNode *create_tiled_node(TiledBuild *build, QTRegion region, size_t index) {
+    if ((uint64_t)region.height * region.width <= build->tile_pixels) {
+        return create_tile(build, region);
+    }
+
+    QTNode *node = arena_alloc_node(build->cursor);
+    if (!node) return NULL;
+
+    int split;
+    node->row = region.row;
+    node->col = region.col;
+    node->height = region.height;
+    node->width = region.width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+    node->intensity = measure_sums(build->pixels, region, build->stats[index].sum,
+                                   build->stats[index].sum_sq, build->max_rmse, &split);
+    if (!split) return node;
+
+    QTRegion children[4];
+    QTNode **slots[4] = {&node->child1, &node->child2, &node->child3, &node->child4};
+    size_t child = index + 1;
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        *slots[k] = create_tiled_node(build, children[k], child);
+        child += build->stats[child].subtree;
+    }
+    return node;
+}
+
+QTNode *create_quadtree_tiled(char *filename, double max_rmse, size_t tile_pixels) {
+    if (!filename || max_rmse < 0) return NULL;
+
+    MappedImage *source = map_image(filename);
+    if (!source) return NULL;
+
+    QTArena *arena = arena_create();
+    if (!arena) {
+        unmap_image(source);
+        return NULL;
+    }
+
+    QTArenaCursor cursor;
+    arena_cursor_init(&cursor, arena);
+    TiledBuild build = {{source->pixels, source->row_stride, source->step, 0}, max_rmse,
+                        tile_pixels ? tile_pixels : QT_DEFAULT_TILE_PIXELS,
+                        NULL, 0, 0, &cursor};
+    QTRegion whole = {0, 0, source->height, source->width};
+    int ok = 1;
+    tiled_stats(&build, whole, &ok);
+    QTNode *root = ok ? create_tiled_node(&build, whole, 0) : NULL;
+    free(build.stats);
+    unmap_image(source);
+
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+QTNode *create_quadtree_parallel(Image *image, double max_rmse, unsigned int nthreads) {
+    if (!image || max_rmse < 0) return NULL;
+    if (nthreads == 1) return create_quadtree(image, max_rmse);
+
+    ThreadPool *pool = thread_pool_create(nthreads);
+    if (!pool) return create_quadtree(image, max_rmse);
+
+    unsigned int ncursors = thread_pool_size(pool) + 1;
+    QTArena *arena = arena_create();
+    QTArenaCursor *cursors = malloc(ncursors * sizeof(QTArenaCursor));
+    IntegralImage integral;
+    if (!arena || !cursors || !build_integral_image_parallel(image, &integral, pool)) {
+        thread_pool_destroy(pool);
+        arena_destroy(arena);
+        free(cursors);
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < ncursors; i++) arena_cursor_init(&cursors[i], arena);
+    ParallelBuild build = {&integral, max_rmse, pool, cursors};
+    QTRegion whole = {0, 0, get_image_height(image), get_image_width(image)};
+    QTNode *root = create_node_parallel(&build, whole);
+    thread_pool_wait(pool);
+
+    thread_pool_destroy(pool);
+    free_integral_image(&integral);
+    free(cursors);
+
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+static int budget_entry_before(QTBudgetEntry *a, QTBudgetEntry *b) {
+    if (a->error != b->error) return a->error > b->error;
+    return a->order < b->order;
+}
+
+static int budget_heap_push(QTBudgetHeap *heap, QTNode *node, double error) {
+    if (heap->count == heap->capacity) {
+        size_t capacity = heap->capacity ? heap->capacity * 2 : 256;
+        QTBudgetEntry *entries = realloc(heap->entries, capacity * sizeof(QTBudgetEntry));
+        if (!entries) return 0;
+        heap->entries = entries;
+        heap->capacity = capacity;
+    }
+
+    size_t i = heap->count++;
+    QTBudgetEntry entry = {error, heap->next_order++, node};
+    while (i > 0 && budget_entry_before(&entry, &heap->entries[(i - 1) / 2])) {
+        heap->entries[i] = heap->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->entries[i] = entry;
+    return 1;
+}
+
+static QTBudgetEntry budget_heap_pop(QTBudgetHeap *heap) {
+    QTBudgetEntry top = heap->entries[0];
+    QTBudgetEntry last = heap->entries[--heap->count];
+
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count &&
+            budget_entry_before(&heap->entries[child + 1], &heap->entries[child])) {
+            child++;
+        }
+        if (!budget_entry_before(&heap->entries[child], &last)) break;
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    if (heap->count > 0) heap->entries[i] = last;
+    return top;
+}
+
+// A childless node for region, queued for splitting unless it is uniform.
+static QTNode *create_budget_leaf(IntegralImage *integral, QTArenaCursor *cursor,
+                                  QTRegion region, QTBudgetHeap *heap) {
+    QTNode *node = arena_alloc_node(cursor);
+    if (!node) return NULL;
+
+    uint64_t count = (uint64_t)region.height * region.width;
+    uint64_t sum, sum_sq;
+    region_sums(integral, region.row, region.col, region.height, region.width, &sum, &sum_sq);
+
+    node->row = region.row;
+    node->col = region.col;
+    node->height = region.height;
+    node->width = region.width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+    node->intensity = (unsigned char)((double)sum / (double)count);
+
+    // Squared error of the leaf, sum((x - mean)^2)
+    double numerator = squared_deviation(count, sum, sum_sq);
+    if (numerator > 0 && !budget_heap_push(heap, node, numerator / (double)count)) {
+        return NULL;
+    }
+    return node;
+}
+
+QTNode *create_quadtree_budget(Image *image, size_t max_nodes) {
+    if (!image || max_nodes == 0) return NULL;
+    if (get_image_width(image) == 0 || get_image_height(image) == 0) return NULL;
+
+    IntegralImage integral;
+    if (!build_integral_image(image, &integral)) return NULL;
+
+    QTArena *arena = arena_create();
+    if (!arena) {
+        free_integral_image(&integral);
+        return NULL;
+    }
+
+    QTArenaCursor cursor;
+    QTBudgetHeap heap = {NULL, 0, 0, 0};
+    arena_cursor_init(&cursor, arena);
+    QTRegion whole = {0, 0, get_image_height(image), get_image_width(image)};
+    QTNode *root = create_budget_leaf(&integral, &cursor, whole, &heap);
+    size_t nodes = 1;
+
+    // Leaves too costly to split are dropped, since a later one may split
+    // into fewer children and still fit
+    while (root && heap.count > 0 && nodes < max_nodes) {
+        QTNode *leaf = budget_heap_pop(&heap).node;
+        QTRegion region = {leaf->row, leaf->col, leaf->height, leaf->width};
+        QTRegion children[4];
+        split_region(region, children);
+
+        size_t nchildren = children[3].height > 0 ? 4 : 2;
+        if (nodes + nchildren > max_nodes) continue;
+
+        QTNode **slots[4] = {&leaf->child1, &leaf->child2, &leaf->child3, &leaf->child4};
+        for (int k = 0; k < 4 && root; k++) {
+            if (children[k].height == 0) continue;
+            *slots[k] = create_budget_leaf(&integral, &cursor, children[k], &heap);
+            if (!*slots[k]) root = NULL;
+        }
+        nodes += nchildren;
+    }
+
+    free(heap.entries);
+    free_integral_image(&integral);
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+QTNode *get_child1(QTNode *node) { return node ? node->child1 : NULL; }
+QTNode *get_child2(QTNode *node) { return node ? node->child2 : NULL; }
+QTNode *get_child3(QTNode *node) { return node ? node->child3 : NULL; }
+QTNode *get_child4(QTNode *node) { return node ? node->child4 : NULL; }
+
+unsigned char get_node_intensity(QTNode *node) {
+    return node ? node->intensity : 0;
+}
+
+QTNode *create_qtree_node(unsigned char intensity, unsigned int row, unsigned int col,
+                          unsigned int height, unsigned int width) {
+    QTNode *node = malloc(sizeof(QTNode));
+    if (!node) return NULL;
+
+    node->intensity = intensity;
+    node->slab_shift = 0;
+    node->row = row;
+    node->col = col;
+    node->height = height;
+    node->width = width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+    return node;
+}
+
+void delete_quadtree(QTNode *root) {
+    if (!root) return;
+    
+    // Trees built by this module live in one arena. When root's subtree is
+    // all the arena still holds, its slabs go in one release; otherwise the
+    // subtree's nodes are kept for reuse, and the arena goes with its last.
+    QTArena *arena = arena_of_node(root);
+    if (arena) {
+        if (count_arena_nodes(arena, root) == arena_live_nodes(arena)) {
+            arena_destroy(arena);
+            return;
+        }
+        arena_release_subtree(arena, root);
+        if (arena_live_nodes(arena) == 0) arena_destroy(arena);
+        return;
+    }
+    
+    delete_quadtree(root->child1);
+    delete_quadtree(root->child2);
+    delete_quadtree(root->child3);
+    delete_quadtree(root->child4);
+    
+    free(root);
+}
+
+// Leaf rectangles are filled a row at a time with memset, clipped to the
+// root's width and to rows [first_row, last_row) of the raster, so malformed
+// trees cannot write past it. Subtrees outside those rows are skipped.
+static void fill_pixels_from_qtree(QTNode *node, unsigned char *pixels, size_t stride,
+                                   unsigned int width, unsigned int first_row,
+                                   unsigned int last_row) {
+    if (!node || !pixels) return;
+    if (node->row >= last_row || (uint64_t)node->row + node->height <= first_row) return;
+    
+    // If leaf node, fill region with node's intensity
+    if (!node->child1 && !node->child2 && !node->child3 && !node->child4) {
+        if (node->col >= width) return;
+        unsigned int top = node->row > first_row ? node->row : first_row;
+        unsigned int bottom = last_row - node->row < node->height ? last_row
+                                                                  : node->row + node->height;
+        unsigned int cols = width - node->col < node->width ? width - node->col : node->width;
+        unsigned char *row = pixels + (size_t)top * stride + node->col;
+        for (unsigned int i = top; i < bottom; i++, row += stride) {
+            memset(row, node->intensity, cols);
+        }
+        return;
+    }
+    
+    // Recursively fill children's regions
+    QTNode *children[4] = {node->child1, node->child2, node->child3, node->child4};
+    for (int k = 0; k < 4; k++) {
+        if (children[k]) {
+            fill_pixels_from_qtree(children[k], pixels, stride, width, first_row, last_row);
+        }
+    }
+}
+
+int qtree_render(QTNode *root, unsigned char *pixels, size_t stride) {
+    if (!root || !pixels || stride < root->width) return 0;
+
+    fill_pixels_from_qtree(root, pixels, stride, root->width, 0, root->height);
+    return 1;
+}
+
+static void render_band_task(void *arg) {
+    QTRenderBand *band = arg;
+    fill_pixels_from_qtree(band->root, band->pixels, band->stride, band->root->width,
+                           band->first_row, band->last_row);
+}
+
+// qtree_render with the rows split into bands filled concurrently. Each band
+// walks only the subtrees that reach into it, which assumes children lie
+// within their parents as in every tree built or loaded here.
+int qtree_render_parallel(QTNode *root, unsigned char *pixels, size_t stride,
+                          unsigned int nthreads) {
+    if (!root || !pixels || stride < root->width) return 0;
+    if (nthreads == 1) return qtree_render(root, pixels, stride);
+
+    ThreadPool *pool = thread_pool_create(nthreads);
+    if (!pool) return qtree_render(root, pixels, stride);
+
+    unsigned int nbands = thread_pool_size(pool) * RENDER_BANDS_PER_THREAD;
+    if (nbands > root->height) nbands = root->height;
+    QTRenderBand *bands = malloc(nbands * sizeof(QTRenderBand));
+    if (!bands) {
+        thread_pool_destroy(pool);
+        return qtree_render(root, pixels, stride);
+    }
+
+    for (unsigned int b = 0; b < nbands; b++) {
+        bands[b].root = root;
+        bands[b].pixels = pixels;
+        bands[b].stride = stride;
+        bands[b].first_row = (unsigned int)((uint64_t)root->height * b / nbands);
+        bands[b].last_row = (unsigned int)((uint64_t)root->height * (b + 1) / nbands);
+        if (!thread_pool_submit(pool, render_band_task, &bands[b])) render_band_task(&bands[b]);
+    }
+    thread_pool_wait(pool);
+
+    thread_pool_destroy(pool);
+    free(bands);
+    return 1;
+}
+
+void save_qtree_as_pnm(QTNode *root, char *filename, PNMFormat format) {
+    if (!root || !filename) return;
+    
+    // Create temporary buffer for pixel data
+    unsigned char *pixels = calloc((size_t)root->width * root->height, sizeof(unsigned char));
+    if (!pixels) return;
+    
+    // Fill buffer with intensities
+    qtree_render(root, pixels, root->width);
+    
+    save_pnm(filename, pixels, root->width, root->height, format);
+    free(pixels);
+}
+
+// save_qtree_as_pnm with both the fill and the text formatting spread over
+// nthreads threads (0 means one per online CPU).
+int save_qtree_as_pnm_parallel(QTNode *root, char *filename, PNMFormat format,
+                               unsigned int nthreads) {
+    if (!root || !filename) return 0;
+
+    unsigned char *pixels = calloc((size_t)root->width * root->height, sizeof(unsigned char));
+    if (!pixels) return 0;
+
+    int ok = qtree_render_parallel(root, pixels, root->width, nthreads) &&
+             save_pnm_parallel(filename, pixels, root->width, root->height, format, nthreads);
+    free(pixels);
+    return ok;
+}
+
+void save_qtree_as_ppm(QTNode *root, char *filename) {
+    save_qtree_as_pnm(root, filename, PNM_P3);
+}
+
+static int node_contains(QTNode *node, unsigned int row, unsigned int col) {
+    return row - node->row < node->height && col - node->col < node->width;
+}
+
+static QTNode *child_containing(QTNode *node, unsigned int row, unsigned int col) {
+    QTNode *children[4] = {node->child1, node->child2, node->child3, node->child4};
+    for (int k = 0; k < 4; k++) {
+        if (children[k] && node_contains(children[k], row, col)) return children[k];
+    }
+    return NULL;
+}
+
+// Pixel (row, col) as save_qtree_as_pnm would write it: the intensity of the
+// leaf covering it, or 0 where no leaf does.
+unsigned char qtree_sample(QTNode *root, unsigned int row, unsigned int col) {
+    if (!root || !node_contains(root, row, col)) return 0;
+
+    QTNode *node = root;
+    while (node->child1 || node->child2 || node->child3 || node->child4) {
+        node = child_containing(node, row, col);
+        if (!node) return 0;
+    }
+    return node->intensity;
+}
+
+// qtree_sample for many points. The path to the last leaf is kept, so each
+// descent starts from the deepest ancestor shared with the previous point;
+// nearby points, e.g. in scanline or Z order, cost little more than one step.
+void qtree_sample_batch(QTNode *root, const unsigned int *rows, const unsigned int *cols,
+                        size_t count, unsigned char *out) {
+    if (!rows || !cols || !out) return;
+
+    QTNode *path[QT_SAMPLE_PATH];
+    int depth = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!root || !node_contains(root, rows[i], cols[i])) {
+            out[i] = 0;
+            continue;
+        }
+
+        while (depth > 0 && !node_contains(path[depth - 1], rows[i], cols[i])) depth--;
+        QTNode *node = depth > 0 ? path[depth - 1] : root;
+        if (depth == 0) path[depth++] = root;
+
+        while (node && (node->child1 || node->child2 || node->child3 || node->child4)) {
+            node = child_containing(node, rows[i], cols[i]);
+            if (node && depth < QT_SAMPLE_PATH) path[depth++] = node;
+        }
+        if (depth == QT_SAMPLE_PATH) depth = 0;
+        out[i] = node ? node->intensity : 0;
+    }
+}
+
+// Paints the part of node's leaves inside view into buf, a view.height by
+// view.width raster. Subtrees that miss the view are not entered.
+static void render_region_recursive(QTNode *node, QTRegion view, unsigned char *buf) {
+    uint64_t top = node->row > view.row ? node->row : view.row;
+    uint64_t left = node->col > view.col ? node->col : view.col;
+    uint64_t bottom = (uint64_t)node->row + node->height;
+    uint64_t right = (uint64_t)node->col + node->width;
+    if (bottom > (uint64_t)view.row + view.height) bottom = (uint64_t)view.row + view.height;
+    if (right > (uint64_t)view.col + view.width) right = (uint64_t)view.col + view.width;
+    if (top >= bottom || left >= right) return;
+
+    if (!node->child1 && !node->child2 && !node->child3 && !node->child4) {
+        for (uint64_t i = top; i < bottom; i++) {
+            memset(buf + (size_t)(i - view.row) * view.width + (left - view.col),
+                   node->intensity, (size_t)(right - left));
+        }
+        return;
+    }
+
+    if (node->child1) render_region_recursive(node->child1, view, buf);
+    if (node->child2) render_region_recursive(node->child2, view, buf);
+    if (node->child3) render_region_recursive(node->child3, view, buf);
+    if (node->child4) render_region_recursive(node->child4, view, buf);
+}
+
+// The height by width window of save_qtree_as_pnm's raster at (row, col),
+// row-major into buf. Pixels outside the tree are 0.
+int qtree_render_region(QTNode *root, unsigned int row, unsigned int col,
+                        unsigned int height, unsigned int width, unsigned char *buf) {
+    if (!root || !buf) return 0;
+
+    memset(buf, 0, (size_t)height * width);
+    QTRegion view = {row, col, height, width};
+    render_region_recursive(root, view, buf);
+    return 1;
+}
+
+// Output pixel i samples source coordinate floor((i + 1/2) * source / output).
+// Returns the first i whose sample is at or after source_start.
+static unsigned int first_output_index(uint64_t source_start, unsigned int source_size,
+                                       unsigned int output_size) {
+    uint64_t scaled = 2 * (uint64_t)output_size * source_start;
+    if (scaled <= source_size) return 0;
+    uint64_t step = 2 * (uint64_t)source_size;
+    uint64_t index = (scaled - source_size + step - 1) / step;
+    return index < output_size ? (unsigned int)index : output_size;
+}
+
+// fill_pixels_from_qtree on the output grid. Nodes covering no sample are
+// skipped, and nodes at max_depth or covering a single output pixel are
+// painted with their own intensity, the mean of their region.
+static void render_lod_recursive(QTNode *node, QTLodTarget *target, unsigned int depth) {
+    unsigned int top = first_output_index(node->row, target->source_height, target->height);
+    unsigned int bottom = first_output_index((uint64_t)node->row + node->height,
+                                             target->source_height, target->height);
+    unsigned int left = first_output_index(node->col, target->source_width, target->width);
+    unsigned int right = first_output_index((uint64_t)node->col + node->width,
+                                            target->source_width, target->width);
+    if (top >= bottom || left >= right) return;
+
+    int leaf = !node->child1 && !node->child2 && !node->child3 && !node->child4;
+    if (leaf || depth == target->max_depth || (bottom - top == 1 && right - left == 1)) {
+        for (unsigned int i = top; i < bottom; i++) {
+            memset(target->pixels + (size_t)i * target->width + left, node->intensity,
+                   right - left);
+        }
+        return;
+    }
+
+    if (node->child1) render_lod_recursive(node->child1, target, depth + 1);
+    if (node->child2) render_lod_recursive(node->child2, target, depth + 1);
+    if (node->child3) render_lod_recursive(node->child3, target, depth + 1);
+    if (node->child4) render_lod_recursive(node->child4, target, depth + 1);
+}
+
+int qtree_render_lod(QTNode *root, unsigned int max_depth, unsigned int width,
+                     unsigned int height, unsigned char *pixels) {
+    if (!root || !pixels || width == 0 || height == 0) return 0;
+    if (root->width >= QT_LOD_MAX_SIDE || root->height >= QT_LOD_MAX_SIDE ||
+        width >= QT_LOD_MAX_SIDE || height >= QT_LOD_MAX_SIDE) {
+        return 0;
+    }
+
+    memset(pixels, 0, (size_t)width * height);
+    QTLodTarget target = {pixels, width, height, root->width, root->height, max_depth};
+    render_lod_recursive(root, &target, 0);
+    return 1;
+}
+
+int save_qtree_as_pnm_lod(QTNode *root, char *filename, PNMFormat format,
+                          unsigned int max_depth, unsigned int width, unsigned int height) {
+    if (!root || !filename) return 0;
+
+    unsigned char *pixels = malloc((size_t)width * height);
+    if (!pixels) return 0;
+
+    int ok = qtree_render_lod(root, max_depth, width, height, pixels) &&
+             save_pnm(filename, pixels, width, height, format);
+    free(pixels);
+    return ok;
+}
+
+static void save_preorder_qt_recursive(QTNode *node, FILE *fp) {
+    if (!node || !fp) return;
+    
+    char type = (node->child1 || node->child2 || node->child3 || node->child4) ? 'N' : 'L';
+    
+    fprintf(fp, "%c %u %u %u %u %u\n", 
+            type,
+            node->intensity,
+            node->row,
+            node->height,
+            node->col,
+            node->width);
+    
+    if (type == 'N') {
+        if (node->child1) save_preorder_qt_recursive(node->child1, fp);
+        if (node->child2) save_preorder_qt_recursive(node->child2, fp);
+        if (node->child3) save_preorder_qt_recursive(node->child3, fp);
+        if (node->child4) save_preorder_qt_recursive(node->child4, fp);
+    }
+}
+
+void save_preorder_qt(QTNode *root, char *filename) {
+    if (!root || !filename) return;
+    
+    FILE *fp = fopen(filename, "w");
+    if (!fp) return;
+    
+    save_preorder_qt_recursive(root, fp);
+    fclose(fp);
+}
+
+static QTNode *load_preorder_qt_recursive(FILE *fp, QTArenaCursor *cursor) {
+    if (!fp) return NULL;
+    
+    char type;
+    unsigned int intensity, row, height, col, width;
+    
+    // Read the node data
+    if (fscanf(fp, " %c %u %u %u %u %u", 
+               &type, &intensity, &row, &height, &col, &width) != 6) {
+        return NULL;
+    }
+    
+    // Skip remaining characters until newline
+    int c;
+    while ((c = fgetc(fp)) != EOF && c != '\n');
+    
+    // Create and initialize node
+    QTNode *node = arena_alloc_node(cursor);
+    if (!node) return NULL;
+    
+    node->intensity = intensity;
+    node->row = row;
+    node->height = height;
+    node->col = col;
+    node->width = width;
+    node->child1 = NULL;
+    node->child2 = NULL;
+    node->child3 = NULL;
+    node->child4 = NULL;
+    
+    // For internal nodes, load children based on the same pattern as create_node uses
+    if (type == 'N') {
+        if (height == 1) {
+            // Single row case
+            node->child1 = load_preorder_qt_recursive(fp, cursor);
+            node->child2 = load_preorder_qt_recursive(fp, cursor);
+        }
+        else if (width == 1) {
+            // Single column case
+            node->child1 = load_preorder_qt_recursive(fp, cursor);
+            node->child3 = load_preorder_qt_recursive(fp, cursor);
+        }
+        else {
+            // Regular case - load all four children
+            node->child1 = load_preorder_qt_recursive(fp, cursor);
+            node->child2 = load_preorder_qt_recursive(fp, cursor);
+            node->child3 = load_preorder_qt_recursive(fp, cursor);
+            node->child4 = load_preorder_qt_recursive(fp, cursor);
+        }
+        
+        // If we failed to load any expected children, return NULL; the
+        // partial tree stays in the arena, which load_preorder_qt releases
+        if (height == 1 && (!node->child1 || !node->child2)) {
+            return NULL;
+        }
+        if (width == 1 && (!node->child1 || !node->child3)) {
+            return NULL;
+        }
+        if (height > 1 && width > 1 && 
+            (!node->child1 || !node->child2 || !node->child3 || !node->child4)) {
+            return NULL;
+        }
+    }
+    
+    return node;
+}
+
+QTNode *load_preorder_qt(char *filename) {
+    if (!filename) return NULL;
+    
+    FILE *fp = fopen(filename, "r");
+    if (!fp) return NULL;
+    
+    QTArena *arena = arena_create();
+    if (!arena) {
+        fclose(fp);
+        return NULL;
+    }
+    
+    QTArenaCursor cursor;
+    arena_cursor_init(&cursor, arena);
+    QTNode *root = load_preorder_qt_recursive(fp, &cursor);
+    fclose(fp);
+    
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+
+static void write_u32(FILE *fp, uint32_t value) {
+    unsigned char bytes[4] = {
+        (unsigned char)value, (unsigned char)(value >> 8),
+        (unsigned char)(value >> 16), (unsigned char)(value >> 24)
+    };
+    fwrite(bytes, 1, sizeof(bytes), fp);
+}
+
+static int read_u32(FILE *fp, uint32_t *value) {
+    unsigned char bytes[4];
+    if (fread(bytes, 1, sizeof(bytes), fp) != sizeof(bytes)) return 0;
+    *value = (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+             (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+    return 1;
+}
+
+static void binary_writer_put(QTBinaryWriter *writer, int split, unsigned char intensity) {
+    if (split) writer->flags |= (unsigned char)(1u << writer->count);
+    writer->intensities[writer->count++] = intensity;
+    if (writer->count == 8) binary_writer_flush(writer);
+}
+
+static void binary_writer_flush(QTBinaryWriter *writer) {
+    if (writer->count == 0) return;
+    fputc(writer->flags, writer->fp);
+    fwrite(writer->intensities, 1, (size_t)writer->count, writer->fp);
+    writer->flags = 0;
+    writer->count = 0;
+}
+
+static int binary_reader_get(QTBinaryReader *reader, int *split, unsigned char *intensity) {
+    if (reader->index == 8) {
+        int flags = getc(reader->fp);
+        if (flags == EOF) return 0;
+        reader->flags = (unsigned char)flags;
+        reader->index = 0;
+    }
+
+    int value = getc(reader->fp);
+    if (value == EOF) return 0;
+    *split = (reader->flags >> reader->index) & 1;
+    *intensity = (unsigned char)value;
+    reader->index++;
+    return 1;
+}
+
+// Fails if the tree does not follow split_region, since only trees with
+// that shape can be rebuilt from split flags alone.
+static int save_preorder_qt_binary_recursive(QTNode *node, QTRegion region,
+                                             QTBinaryWriter *writer) {
+    if (node->row != region.row || node->col != region.col ||
+        node->height != region.height || node->width != region.width) {
+        return 0;
+    }
+
+    int split = node->child1 || node->child2 || node->child3 || node->child4;
+    binary_writer_put(writer, split, node->intensity);
+    if (!split) return 1;
+
+    QTRegion children[4];
+    QTNode *nodes[4] = {node->child1, node->child2, node->child3, node->child4};
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if ((children[k].height > 0) != (nodes[k] != NULL)) return 0;
+        if (nodes[k] && !save_preorder_qt_binary_recursive(nodes[k], children[k], writer)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int save_preorder_qt_binary(QTNode *root, char *filename) {
+    if (!root || !filename) return 0;
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) return 0;
+
+    fwrite(QT_BINARY_MAGIC, 1, 4, fp);
+    write_u32(fp, root->width);
+    write_u32(fp, root->height);
+
+    QTBinaryWriter writer = {fp, 0, {0}, 0};
+    QTRegion whole = {0, 0, root->height, root->width};
+    int ok = save_preorder_qt_binary_recursive(root, whole, &writer);
+    binary_writer_flush(&writer);
+
+    if (ferror(fp)) ok = 0;
+    if (fclose(fp) != 0) ok = 0;
+    return ok;
+}
+
+static QTNode *load_preorder_qt_binary_recursive(QTBinaryReader *reader, QTRegion region,
+                                                 QTArenaCursor *cursor) {
+    int split;
+    unsigned char intensity;
+    if (!binary_reader_get(reader, &split, &intensity)) return NULL;
+
+    QTNode *node = arena_alloc_node(cursor);
+    if (!node) return NULL;
+
+    node->intensity = intensity;
+    node->row = region.row;
+    node->col = region.col;
+    node->height = region.height;
+    node->width = region.width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+    if (!split) return node;
+
+    QTRegion children[4];
+    QTNode **slots[4] = {&node->child1, &node->child2, &node->child3, &node->child4};
+    split_region(region, children);
+    if (children[0].height == 0) return NULL;   // A single pixel cannot split
+
+    // As in load_preorder_qt, a partial tree is left to the arena
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        *slots[k] = load_preorder_qt_binary_recursive(reader, children[k], cursor);
+        if (!*slots[k]) return NULL;
+    }
+    return node;
+}
+
+QTNode *load_preorder_qt_binary(char *filename) {
+    if (!filename) return NULL;
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+
+    char magic[4];
+    uint32_t width, height;
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, QT_BINARY_MAGIC, 4) != 0 ||
+        !read_u32(fp, &width) || !read_u32(fp, &height) || width == 0 || height == 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    QTArena *arena = arena_create();
+    if (!arena) {
+        fclose(fp);
+        return NULL;
+    }
+
+    QTArenaCursor cursor;
+    arena_cursor_init(&cursor, arena);
+    QTBinaryReader reader = {fp, 0, 8};
+    QTRegion whole = {0, 0, height, width};
+    QTNode *root = load_preorder_qt_binary_recursive(&reader, whole, &cursor);
+    fclose(fp);
+
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+// create_node and the preorder writers fused: each record is written as soon
+// as its split is decided, so no QTNode is ever allocated.
+static void encode_preorder_node(QTStreamEncoder *encoder, QTRegion region) {
+    int split;
+    unsigned char intensity = measure_region(encoder->integral, region,
+                                             encoder->max_rmse, &split);
+
+    if (encoder->binary) {
+        binary_writer_put(encoder->binary, split, intensity);
+    } else {
+        fprintf(encoder->fp, "%c %u %u %u %u %u\n", split ? 'N' : 'L', intensity,
+                region.row, region.height, region.col, region.width);
+    }
+    if (!split) return;
+
+    QTRegion children[4];
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height > 0) encode_preorder_node(encoder, children[k]);
+    }
+}
+
+static int encode_preorder_file(Image *image, double max_rmse, char *filename, int binary) {
+    if (!image || max_rmse < 0 || !filename) return 0;
+    if (get_image_width(image) == 0 || get_image_height(image) == 0) return 0;
+
+    IntegralImage integral;
+    if (!build_integral_image(image, &integral)) return 0;
+
+    FILE *fp = fopen(filename, binary ? "wb" : "w");
+    if (!fp) {
+        free_integral_image(&integral);
+        return 0;
+    }
+
+    unsigned int width = get_image_width(image);
+    unsigned int height = get_image_height(image);
+    QTBinaryWriter writer = {fp, 0, {0}, 0};
+    QTStreamEncoder encoder = {&integral, max_rmse, fp, binary ? &writer : NULL};
+    if (binary) {
+        fwrite(QT_BINARY_MAGIC, 1, 4, fp);
+        write_u32(fp, width);
+        write_u32(fp, height);
+    }
+
+    QTRegion whole = {0, 0, height, width};
+    encode_preorder_node(&encoder, whole);
+    if (binary) binary_writer_flush(&writer);
+    free_integral_image(&integral);
+
+    int ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = 0;
+    return ok;
+}
+
+int encode_preorder_qt(Image *image, double max_rmse, char *filename) {
+    return encode_preorder_file(image, max_rmse, filename, 0);
+}
+
+int encode_preorder_qt_binary(Image *image, double max_rmse, char *filename) {
+    return encode_preorder_file(image, max_rmse, filename, 1);
+}
+
+// Fills a leaf's rectangle, rejecting leaves that fall outside the raster.
+static int paint_leaf(QTRaster *raster, QTRegion region, unsigned char intensity) {
+    if (region.row > raster->height || region.height > raster->height - region.row ||
+        region.col > raster->width || region.width > raster->width - region.col) {
+        return 0;
+    }
+
+    unsigned char *row = raster->pixels + (size_t)region.row * raster->width + region.col;
+    for (unsigned int i = 0; i < region.height; i++, row += raster->width) {
+        memset(row, intensity, region.width);
+    }
+    return 1;
+}
+
+// Reads one line of the text preorder format, as load_preorder_qt_recursive
+// does.
+static int read_text_node(FILE *fp, char *type, unsigned char *intensity, QTRegion *region) {
+    unsigned int value;
+    if (fscanf(fp, " %c %u %u %u %u %u", type, &value, &region->row, &region->height,
+               &region->col, &region->width) != 6) {
+        return 0;
+    }
+
+    int c;
+    while ((c = fgetc(fp)) != EOF && c != '\n');
+    *intensity = (unsigned char)value;
+    return 1;
+}
+
+// Children are read as load_preorder_qt_recursive reads them, so the pixels
+// match load_preorder_qt followed by save_qtree_as_pnm. Only the chain of
+// nodes above the current one is live.
+static int render_text_node(FILE *fp, QTRaster *raster, char type, unsigned char intensity,
+                            QTRegion region, unsigned int depth) {
+    if (type != 'N') return paint_leaf(raster, region, intensity);
+    if (depth == QT_MAX_TEXT_DEPTH) return 0;
+
+    int nchildren = (region.height == 1 || region.width == 1) ? 2 : 4;
+    for (int k = 0; k < nchildren; k++) {
+        char child_type;
+        unsigned char child_intensity;
+        QTRegion child;
+        if (!read_text_node(fp, &child_type, &child_intensity, &child) ||
+            !render_text_node(fp, raster, child_type, child_intensity, child, depth + 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int render_binary_node(QTBinaryReader *reader, QTRaster *raster, QTRegion region) {
+    int split;
+    unsigned char intensity;
+    if (!binary_reader_get(reader, &split, &intensity)) return 0;
+    if (!split) return paint_leaf(raster, region, intensity);
+
+    QTRegion children[4];
+    split_region(region, children);
+    if (children[0].height == 0) return 0;
+
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height > 0 && !render_binary_node(reader, raster, children[k])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Allocates the raster once the root size is known and paints every leaf
+// into it. On failure the raster may still need freeing.
+static int render_preorder_qt_file(FILE *fp, QTRaster *raster) {
+    char magic[4];
+    if (fread(magic, 1, 4, fp) == 4 && memcmp(magic, QT_BINARY_MAGIC, 4) == 0) {
+        uint32_t width, height;
+        if (!read_u32(fp, &width) || !read_u32(fp, &height) || width == 0 || height == 0) {
+            return 0;
+        }
+
+        raster->pixels = calloc((size_t)width * height, sizeof(unsigned char));
+        if (!raster->pixels) return 0;
+        raster->width = width;
+        raster->height = height;
+
+        QTBinaryReader reader = {fp, 0, 8};
+        QTRegion whole = {0, 0, height, width};
+        return render_binary_node(&reader, raster, whole);
+    }
+
+    char type;
+    unsigned char intensity;
+    QTRegion root;
+    rewind(fp);
+    if (!read_text_node(fp, &type, &intensity, &root) || root.width == 0 || root.height == 0) {
+        return 0;
+    }
+
+    raster->pixels = calloc((size_t)root.width * root.height, sizeof(unsigned char));
+    if (!raster->pixels) return 0;
+    raster->width = root.width;
+    raster->height = root.height;
+    return render_text_node(fp, raster, type, intensity, root, 0);
+}
+
+int render_preorder_qt(char *tree_filename, char *image_filename, PNMFormat format) {
+    if (!tree_filename || !image_filename) return 0;
+
+    FILE *fp = fopen(tree_filename, "rb");
+    if (!fp) return 0;
+
+    QTRaster raster = {NULL, 0, 0};
+    int ok = render_preorder_qt_file(fp, &raster);
+    fclose(fp);
+
+    if (ok) ok = save_pnm(image_filename, raster.pixels, raster.width, raster.height, format);
+    free(raster.pixels);
+    return ok;
+}
+
+static void init_coded_model(QTCodedModel *model) {
+    rc_init_probs(&model->split[0][0], QT_CODED_DEPTHS * 4);
+    rc_init_probs(&model->leaf_residual[0][0], QT_CODED_SIZE_CLASSES * 256);
+    rc_init_probs(model->node_residual, 256);
+}
+
+static RCProb *coded_leaf_model(QTCodedModel *model, QTRegion region) {
+    uint64_t area = (uint64_t)region.height * region.width;
+    unsigned int size_class = 0;
+    while (area > 1 && size_class < QT_CODED_SIZE_CLASSES - 1) {
+        area >>= 2;
+        size_class++;
+    }
+    return model->leaf_residual[size_class];
+}
+
+// Prediction for child number index (0-based among present children) from
+// the intensities of the children before it.
+static unsigned char predict_child(int index, int nchildren, const unsigned char *siblings,
+                                   unsigned char parent_prediction) {
+    if (index == 0) return parent_prediction;
+    if (index < 3 || nchildren < 4) return siblings[0];
+
+    // Median of child2, child3 and the plane through child1..child3
+    int left = siblings[2], above = siblings[1], corner = siblings[0];
+    int plane = left + above - corner;
+    int low = left < above ? left : above;
+    int high = left < above ? above : left;
+    if (plane < low) return (unsigned char)low;
+    if (plane > high) return (unsigned char)high;
+    return (unsigned char)plane;
+}
+
+static unsigned char children_mean(QTRegion *children, QTNode **nodes, QTRegion region) {
+    uint64_t total = 0;
+    for (int k = 0; k < 4; k++) {
+        if (nodes[k]) total += (uint64_t)nodes[k]->intensity * children[k].height * children[k].width;
+    }
+    return (unsigned char)(total / ((uint64_t)region.height * region.width));
+}
+
+// Like save_preorder_qt_binary_recursive, fails on trees that do not follow
+// split_region.
+static int encode_coded_node(QTCodedModel *model, RangeEncoder *encoder, QTNode *node,
+                             QTRegion region, unsigned int depth,
+                             unsigned char prediction, int split_siblings) {
+    if (node->row != region.row || node->col != region.col ||
+        node->height != region.height || node->width != region.width) {
+        return 0;
+    }
+
+    QTRegion children[4];
+    QTNode *nodes[4] = {node->child1, node->child2, node->child3, node->child4};
+    int split = nodes[0] || nodes[1] || nodes[2] || nodes[3];
+    split_region(region, children);
+
+    if (children[0].height > 0) {
+        unsigned int context = depth < QT_CODED_DEPTHS ? depth : QT_CODED_DEPTHS - 1;
+        rc_encode_bit(encoder, &model->split[context][split_siblings], split);
+    } else if (split) {
+        return 0;
+    }
+
+    if (!split) {
+        rc_encode_tree(encoder, coded_leaf_model(model, region), 8,
+                       (unsigned char)(node->intensity - prediction));
+        return 1;
+    }
+
+    int nchildren = 0;
+    for (int k = 0; k < 4; k++) {
+        if ((children[k].height > 0) != (nodes[k] != NULL)) return 0;
+        nchildren += nodes[k] != NULL;
+    }
+
+    unsigned char siblings[4];
+    int index = 0, split_children = 0;
+    for (int k = 0; k < 4; k++) {
+        if (!nodes[k]) continue;
+        unsigned char child_prediction = predict_child(index, nchildren, siblings, prediction);
+        if (!encode_coded_node(model, encoder, nodes[k], children[k], depth + 1,
+                               child_prediction, split_children)) {
+            return 0;
+        }
+        siblings[index++] = nodes[k]->intensity;
+        split_children += nodes[k]->child1 || nodes[k]->child2 ||
+                          nodes[k]->child3 || nodes[k]->child4;
+    }
+
+    rc_encode_tree(encoder, model->node_residual, 8,
+                   (unsigned char)(node->intensity - children_mean(children, nodes, region)));
+    return 1;
+}
+
+int save_preorder_qt_compressed(QTNode *root, char *filename) {
+    if (!root || !filename) return 0;
+
+    QTCodedModel model;
+    RangeEncoder encoder;
+    init_coded_model(&model);
+    rc_encoder_init(&encoder);
+
+    QTRegion whole = {0, 0, root->height, root->width};
+    if (!encode_coded_node(&model, &encoder, root, whole, 0, 128, 0) ||
+        !rc_encoder_finish(&encoder)) {
+        rc_encoder_free(&encoder);
+        return 0;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        rc_encoder_free(&encoder);
+        return 0;
+    }
+
+    fwrite(QT_CODED_MAGIC, 1, 4, fp);
+    write_u32(fp, root->width);
+    write_u32(fp, root->height);
+    fwrite(encoder.data, 1, encoder.size, fp);
+    rc_encoder_free(&encoder);
+
+    int ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = 0;
+    return ok;
+}
+
+static QTNode *decode_coded_node(QTCodedModel *model, RangeDecoder *decoder,
+                                 QTArenaCursor *cursor, QTRegion region, unsigned int depth,
+                                 unsigned char prediction, int split_siblings) {
+    QTRegion children[4];
+    split_region(region, children);
+
+    int split = 0;
+    if (children[0].height > 0) {
+        unsigned int context = depth < QT_CODED_DEPTHS ? depth : QT_CODED_DEPTHS - 1;
+        split = rc_decode_bit(decoder, &model->split[context][split_siblings]);
+    }
+    if (decoder->overrun) return NULL;
+
+    QTNode *node = arena_alloc_node(cursor);
+    if (!node) return NULL;
+
+    node->row = region.row;
+    node->col = region.col;
+    node->height = region.height;
+    node->width = region.width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+
+    if (!split) {
+        unsigned int residual = rc_decode_tree(decoder, coded_leaf_model(model, region), 8);
+        node->intensity = (unsigned char)(prediction + residual);
+        return decoder->overrun ? NULL : node;
+    }
+
+    // A partial tree is left to the arena, as in load_preorder_qt
+    QTNode **slots[4] = {&node->child1, &node->child2, &node->child3, &node->child4};
+    int nchildren = children[3].height > 0 ? 4 : 2;
+    unsigned char siblings[4];
+    int index = 0, split_children = 0;
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        unsigned char child_prediction = predict_child(index, nchildren, siblings, prediction);
+        QTNode *child = decode_coded_node(model, decoder, cursor, children[k], depth + 1,
+                                          child_prediction, split_children);
+        if (!child) return NULL;
+        *slots[k] = child;
+        siblings[index++] = child->intensity;
+        split_children += child->child1 || child->child2 || child->child3 || child->child4;
+    }
+
+    QTNode *nodes[4] = {node->child1, node->child2, node->child3, node->child4};
+    unsigned int residual = rc_decode_tree(decoder, model->node_residual, 8);
+    node->intensity = (unsigned char)(children_mean(children, nodes, region) + residual);
+    return decoder->overrun ? NULL : node;
+}
+
+// Reads a whole file into a heap buffer; NULL if it cannot be read.
+static unsigned char *read_file(char *filename, size_t *size) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+
+    size_t capacity = 1 << 16;
+    unsigned char *data = malloc(capacity);
+    *size = 0;
+    while (data) {
+        *size += fread(data + *size, 1, capacity - *size, fp);
+        if (*size < capacity) break;
+
+        unsigned char *grown = realloc(data, capacity * 2);
+        if (!grown) {
+            free(data);
+            data = NULL;
+            break;
+        }
+        data = grown;
+        capacity *= 2;
+    }
+
+    if (data && ferror(fp)) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+QTNode *load_preorder_qt_compressed(char *filename) {
+    if (!filename) return NULL;
+
+    size_t size;
+    unsigned char *data = read_file(filename, &size);
+    if (!data) return NULL;
+
+    uint32_t width = 0, height = 0;
+    if (size >= 12 && memcmp(data, QT_CODED_MAGIC, 4) == 0) {
+        for (int i = 3; i >= 0; i--) {
+            width = (width << 8) | data[4 + i];
+            height = (height << 8) | data[8 + i];
+        }
+    }
+
+    QTArena *arena = (width && height) ? arena_create() : NULL;
+    if (!arena) {
+        free(data);
+        return NULL;
+    }
+
+    QTCodedModel model;
+    RangeDecoder decoder;
+    QTArenaCursor cursor;
+    init_coded_model(&model);
+    rc_decoder_init(&decoder, data + 12, size - 12);
+    arena_cursor_init(&cursor, arena);
+
+    QTRegion whole = {0, 0, height, width};
+    QTNode *root = decode_coded_node(&model, &decoder, &cursor, whole, 0, 128, 0);
+    free(data);
+
+    if (!root || decoder.overrun) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+static int linear_append(QTLinearTree *tree, unsigned char intensity) {
+    if (tree->count == UINT32_MAX) return 0;    // Subtree sizes are 32-bit
+    if (tree->count == tree->capacity) {
+        size_t capacity = tree->capacity ? tree->capacity * 2 : 1024;
+        unsigned char *intensities = realloc(tree->intensity, capacity);
+        if (!intensities) return 0;
+        tree->intensity = intensities;
+
+        uint32_t *subtree = realloc(tree->subtree, capacity * sizeof(uint32_t));
+        if (!subtree) return 0;
+        tree->subtree = subtree;
+        tree->capacity = capacity;
+    }
+
+    tree->intensity[tree->count] = intensity;
+    tree->subtree[tree->count] = 1;
+    tree->count++;
+    return 1;
+}
+
+static QTLinearTree *alloc_linear_tree(unsigned int width, unsigned int height) {
+    QTLinearTree *tree = calloc(1, sizeof(QTLinearTree));
+    if (!tree) return NULL;
+    tree->width = width;
+    tree->height = height;
+    return tree;
+}
+
+// create_node appending to the arrays instead of allocating nodes; a node's
+// subtree size is filled in once its children are done.
+static void build_linear_node(QTLinearTree *tree, IntegralImage *integral,
+                              QTRegion region, double max_rmse, int *ok) {
+    int split;
+    unsigned char intensity = measure_region(integral, region, max_rmse, &split);
+    size_t index = tree->count;
+    if (!linear_append(tree, intensity)) {
+        *ok = 0;
+        return;
+    }
+    if (!split) return;
+
+    QTRegion children[4];
+    split_region(region, children);
+    for (int k = 0; k < 4 && *ok; k++) {
+        if (children[k].height > 0) build_linear_node(tree, integral, children[k], max_rmse, ok);
+    }
+    tree->subtree[index] = (uint32_t)(tree->count - index);
+}
+
+QTLinearTree *create_linear_quadtree(Image *image, double max_rmse) {
+    if (!image || max_rmse < 0) return NULL;
+
+    unsigned int width = get_image_width(image);
+    unsigned int height = get_image_height(image);
+    if (width == 0 || height == 0) return NULL;
+
+    IntegralImage integral;
+    if (!build_integral_image(image, &integral)) return NULL;
+
+    QTLinearTree *tree = alloc_linear_tree(width, height);
+    int ok = tree != NULL;
+    if (tree) {
+        QTRegion whole = {0, 0, height, width};
+        build_linear_node(tree, &integral, whole, max_rmse, &ok);
+    }
+    free_integral_image(&integral);
+
+    if (!ok) {
+        delete_linear_quadtree(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+// Like save_preorder_qt_binary_recursive, fails on trees that do not follow
+// split_region.
+static int linear_from_node(QTLinearTree *tree, QTNode *node, QTRegion region) {
+    if (node->row != region.row || node->col != region.col ||
+        node->height != region.height || node->width != region.width) {
+        return 0;
+    }
+
+    size_t index = tree->count;
+    if (!linear_append(tree, node->intensity)) return 0;
+
+    QTNode *nodes[4] = {node->child1, node->child2, node->child3, node->child4};
+    if (!nodes[0] && !nodes[1] && !nodes[2] && !nodes[3]) return 1;
+
+    QTRegion children[4];
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if ((children[k].height > 0) != (nodes[k] != NULL)) return 0;
+        if (nodes[k] && !linear_from_node(tree, nodes[k], children[k])) return 0;
+    }
+    tree->subtree[index] = (uint32_t)(tree->count - index);
+    return 1;
+}
+
+QTLinearTree *linear_from_quadtree(QTNode *root) {
+    if (!root) return NULL;
+
+    QTLinearTree *tree = alloc_linear_tree(root->width, root->height);
+    if (!tree) return NULL;
+
+    QTRegion whole = {0, 0, root->height, root->width};
+    if (!linear_from_node(tree, root, whole)) {
+        delete_linear_quadtree(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+static QTNode *node_from_linear(QTLinearTree *tree, size_t index, QTRegion region,
+                                QTArenaCursor *cursor) {
+    QTNode *node = arena_alloc_node(cursor);
+    if (!node) return NULL;
+
+    node->intensity = tree->intensity[index];
+    node->row = region.row;
+    node->col = region.col;
+    node->height = region.height;
+    node->width = region.width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+    if (tree->subtree[index] == 1) return node;
+
+    QTRegion children[4];
+    QTNode **slots[4] = {&node->child1, &node->child2, &node->child3, &node->child4};
+    size_t child = index + 1;
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        *slots[k] = node_from_linear(tree, child, children[k], cursor);
+        if (!*slots[k]) return NULL;
+        child += tree->subtree[child];
+    }
+    return node;
+}
+
+QTNode *quadtree_from_linear(QTLinearTree *tree) {
+    if (!tree || tree->count == 0) return NULL;
+
+    QTArena *arena = arena_create();
+    if (!arena) return NULL;
+
+    QTArenaCursor cursor;
+    arena_cursor_init(&cursor, arena);
+    QTRegion whole = {0, 0, tree->height, tree->width};
+    QTNode *root = node_from_linear(tree, 0, whole, &cursor);
+
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+void delete_linear_quadtree(QTLinearTree *tree) {
+    if (!tree) return;
+    free(tree->intensity);
+    free(tree->subtree);
+    free(tree);
+}
+
+QTLinearNode get_linear_root(QTLinearTree *tree) {
+    QTLinearNode root = {QT_LINEAR_NONE, 0, 0, 0, 0};
+    if (tree && tree->count > 0) {
+        root.index = 0;
+        root.height = tree->height;
+        root.width = tree->width;
+    }
+    return root;
+}
+
+// Child number which (0-based) of node, found by skipping the subtrees of
+// the children before it.
+static QTLinearNode get_linear_child(QTLinearTree *tree, QTLinearNode node, int which) {
+    QTLinearNode child = {QT_LINEAR_NONE, 0, 0, 0, 0};
+    if (!tree || node.index >= tree->count || tree->subtree[node.index] == 1) return child;
+
+    QTRegion region = {node.row, node.col, node.height, node.width};
+    QTRegion children[4];
+    split_region(region, children);
+    if (children[which].height == 0) return child;
+
+    size_t index = node.index + 1;
+    for (int k = 0; k < which; k++) {
+        if (children[k].height > 0) index += tree->subtree[index];
+    }
+
+    child.index = index;
+    child.row = children[which].row;
+    child.col = children[which].col;
+    child.height = children[which].height;
+    child.width = children[which].width;
+    return child;
+}
+
+QTLinearNode get_linear_child1(QTLinearTree *tree, QTLinearNode node) {
+    return get_linear_child(tree, node, 0);
+}
+
+QTLinearNode get_linear_child2(QTLinearTree *tree, QTLinearNode node) {
+    return get_linear_child(tree, node, 1);
+}
+
+QTLinearNode get_linear_child3(QTLinearTree *tree, QTLinearNode node) {
+    return get_linear_child(tree, node, 2);
+}
+
+QTLinearNode get_linear_child4(QTLinearTree *tree, QTLinearNode node) {
+    return get_linear_child(tree, node, 3);
+}
+
+unsigned char get_linear_intensity(QTLinearTree *tree, QTLinearNode node) {
+    return (tree && node.index < tree->count) ? tree->intensity[node.index] : 0;
+}
+
+// One front-to-back pass over the arrays: the stack holds the regions of the
+// nodes still to come, so the next node's region is always on top.
+int save_linear_qtree_as_pnm(QTLinearTree *tree, char *filename, PNMFormat format) {
+    if (!tree || tree->count == 0 || !filename) return 0;
+
+    QTRaster raster = {NULL, tree->width, tree->height};
+    raster.pixels = calloc((size_t)tree->width * tree->height, sizeof(unsigned char));
+    if (!raster.pixels) return 0;
+
+    QTRegion stack[QT_LINEAR_STACK];
+    int top = 0;
+    stack[top++] = (QTRegion){0, 0, tree->height, tree->width};
+
+    int ok = 1;
+    for (size_t i = 0; i < tree->count && ok; i++) {
+        if (top == 0) {
+            ok = 0;
+            break;
+        }
+        QTRegion region = stack[--top];
+        if (tree->subtree[i] == 1) {
+            ok = paint_leaf(&raster, region, tree->intensity[i]);
+            continue;
+        }
+
+        QTRegion children[4];
+        split_region(region, children);
+        for (int k = 3; k >= 0; k--) {
+            if (children[k].height == 0) continue;
+            if (top == QT_LINEAR_STACK) {
+                ok = 0;
+                break;
+            }
+            stack[top++] = children[k];
+        }
+    }
+
+    if (ok && top == 0) {
+        ok = save_pnm(filename, raster.pixels, raster.width, raster.height, format);
+    } else {
+        ok = 0;
+    }
+    free(raster.pixels);
+    return ok;
+}
+
+// create_linear_quadtree at max_rmse 0, also recording every node's RMSE.
+static void build_multi_node(QTMultiTree *multi, IntegralImage *integral, QTRegion region,
+                             int *ok) {
+    QTLinearTree *tree = multi->tree;
+    uint64_t count = (uint64_t)region.height * region.width;
+    uint64_t sum, sum_sq;
+    region_sums(integral, region.row, region.col, region.height, region.width, &sum, &sum_sq);
+
+    size_t index = tree->count;
+    size_t capacity = tree->capacity;
+    if (!linear_append(tree, (unsigned char)((double)sum / (double)count))) {
+        *ok = 0;
+        return;
+    }
+    if (tree->capacity != capacity) {
+        double *rmse = realloc(multi->rmse, tree->capacity * sizeof(double));
+        if (!rmse) {
+            *ok = 0;
+            return;
+        }
+        multi->rmse = rmse;
+    }
+    multi->rmse[index] = calculate_rmse(count, sum, sum_sq);
+    if (squared_deviation(count, sum, sum_sq) == 0) return;     // Uniform, so never split
+
+    QTRegion children[4];
+    split_region(region, children);
+    for (int k = 0; k < 4 && *ok; k++) {
+        if (children[k].height > 0) build_multi_node(multi, integral, children[k], ok);
+    }
+    tree->subtree[index] = (uint32_t)(tree->count - index);
+}
+
+QTMultiTree *create_multi_quadtree(Image *image) {
+    if (!image) return NULL;
+
+    unsigned int width = get_image_width(image);
+    unsigned int height = get_image_height(image);
+    if (width == 0 || height == 0) return NULL;
+
+    QTMultiTree *multi = calloc(1, sizeof(QTMultiTree));
+    if (!multi) return NULL;
+    multi->image = image;
+    multi->tree = alloc_linear_tree(width, height);
+
+    IntegralImage integral;
+    int ok = multi->tree != NULL && build_integral_image(image, &integral);
+    if (ok) {
+        QTRegion whole = {0, 0, height, width};
+        build_multi_node(multi, &integral, whole, &ok);
+        free_integral_image(&integral);
+    }
+
+    if (!ok) {
+        delete_multi_quadtree(multi);
+        return NULL;
+    }
+    return multi;
+}
+
+void delete_multi_quadtree(QTMultiTree *multi) {
+    if (!multi) return;
+    delete_linear_quadtree(multi->tree);
+    free(multi->rmse);
+    free(multi);
+}
+
+// The split test of create_quadtree for the node at index. Only a recorded
+// RMSE within rounding distance of max_rmse sends it back to the pixels.
+static int multi_splits(QTMultiTree *multi, size_t index, QTRegion region, double max_rmse) {
+    if (multi->tree->subtree[index] == 1) return 0;
+
+    double rmse = multi->rmse[index];
+    double avg = 0.0;
+    if (fabs(rmse - max_rmse) <= 1e-6 * max_rmse) {
+        uint64_t sum = 0;
+        QTPixels pixels = image_pixels(multi->image);
+        for (unsigned int i = region.row; i < region.row + region.height; i++) {
+            unsigned int j = region.col, end = region.col + region.width;
+            while (j < end) {
+                unsigned int run;
+                const unsigned char *pixel = pixel_run(pixels, i, j, &run);
+                unsigned int stop = end - j < run ? end : j + run;
+                for (; j < stop; j++) sum += *pixel++;
+            }
+        }
+        avg = (double)sum / ((double)region.height * region.width);
+    }
+    return exceeds_max_rmse(image_pixels(multi->image), region.row, region.col, region.height,
+                            region.width, avg, rmse, max_rmse);
+}
+
+static int extract_linear_node(QTMultiTree *multi, QTLinearTree *tree, size_t index,
+                               QTRegion region, double max_rmse) {
+    size_t out = tree->count;
+    if (!linear_append(tree, multi->tree->intensity[index])) return 0;
+    if (!multi_splits(multi, index, region, max_rmse)) return 1;
+
+    QTRegion children[4];
+    size_t child = index + 1;
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        if (!extract_linear_node(multi, tree, child, children[k], max_rmse)) return 0;
+        child += multi->tree->subtree[child];
+    }
+    tree->subtree[out] = (uint32_t)(tree->count - out);
+    return 1;
+}
+
+QTLinearTree *extract_linear_quadtree(QTMultiTree *multi, double max_rmse) {
+    if (!multi || max_rmse < 0) return NULL;
+
+    QTLinearTree *tree = alloc_linear_tree(multi->tree->width, multi->tree->height);
+    if (!tree) return NULL;
+
+    QTRegion whole = {0, 0, tree->height, tree->width};
+    if (!extract_linear_node(multi, tree, 0, whole, max_rmse)) {
+        delete_linear_quadtree(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+QTNode *extract_quadtree(QTMultiTree *multi, double max_rmse) {
+    QTLinearTree *tree = extract_linear_quadtree(multi, max_rmse);
+    QTNode *root = quadtree_from_linear(tree);
+    delete_linear_quadtree(tree);
+    return root;
+}
+
+// save_linear_qtree_as_pnm over the full tree, skipping the subtrees of
+// nodes that do not split at max_rmse.
+int save_multi_qtree_as_pnm(QTMultiTree *multi, double max_rmse, char *filename,
+                            PNMFormat format) {
+    if (!multi || max_rmse < 0 || !filename) return 0;
+
+    QTLinearTree *tree = multi->tree;
+    QTRaster raster = {NULL, tree->width, tree->height};
+    raster.pixels = calloc((size_t)tree->width * tree->height, sizeof(unsigned char));
+    if (!raster.pixels) return 0;
+
+    QTRegion stack[QT_LINEAR_STACK];
+    int top = 0;
+    stack[top++] = (QTRegion){0, 0, tree->height, tree->width};
+
+    size_t i = 0;
+    while (top > 0) {
+        QTRegion region = stack[--top];
+        if (!multi_splits(multi, i, region, max_rmse)) {
+            paint_leaf(&raster, region, tree->intensity[i]);
+            i += tree->subtree[i];
+            continue;
+        }
+
+        QTRegion children[4];
+        split_region(region, children);
+        for (int k = 3; k >= 0; k--) {
+            if (children[k].height > 0) stack[top++] = children[k];
+        }
+        i++;
+    }
+
+    int ok = save_pnm(filename, raster.pixels, raster.width, raster.height, format);
+    free(raster.pixels);
+    return ok;
+}
+
+static size_t dag_hash(const QTDagNode *node) {
+    uint64_t hash = node->intensity;
+    for (int k = 0; k < 4; k++) {
+        hash = (hash ^ node->child[k]) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+    }
+    return (size_t)hash;
+}
+
+static int dag_same_node(const QTDagNode *a, const QTDagNode *b) {
+    return a->intensity == b->intensity && a->child[0] == b->child[0] &&
+           a->child[1] == b->child[1] && a->child[2] == b->child[2] &&
+           a->child[3] == b->child[3];
+}
+
+// Doubles the table once it is half full.
+static int dag_table_grow(QTDag *dag, QTDagTable *table) {
+    if (table->slots && dag->count < (table->mask + 1) / 2) return 1;
+
+    size_t size = table->slots ? (table->mask + 1) * 2 : 1024;
+    uint32_t *slots = calloc(size, sizeof(uint32_t));
+    if (!slots) return 0;
+    for (size_t i = 0; i < dag->count; i++) {
+        size_t slot = dag_hash(&dag->nodes[i]) & (size - 1);
+        while (slots[slot]) slot = (slot + 1) & (size - 1);
+        slots[slot] = (uint32_t)(i + 1);
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->mask = size - 1;
+    return 1;
+}
+
+static int dag_append(QTDag *dag, QTDagNode node) {
+    if (dag->count == UINT32_MAX) return 0;     // Indexes are 32-bit
+    if (dag->count == dag->capacity) {
+        size_t capacity = dag->capacity ? dag->capacity * 2 : 1024;
+        QTDagNode *nodes = realloc(dag->nodes, capacity * sizeof(QTDagNode));
+        if (!nodes) return 0;
+        dag->nodes = nodes;
+        dag->capacity = capacity;
+    }
+    dag->nodes[dag->count++] = node;
+    return 1;
+}
+
+// Index of the node equal to node, added if there is none yet.
+static uint32_t dag_intern(QTDag *dag, QTDagTable *table, QTDagNode node) {
+    if (!dag_table_grow(dag, table)) return QT_DAG_NONE;
+
+    size_t slot = dag_hash(&node) & table->mask;
+    while (table->slots[slot]) {
+        uint32_t index = table->slots[slot] - 1;
+        if (dag_same_node(&dag->nodes[index], &node)) return index;
+        slot = (slot + 1) & table->mask;
+    }
+
+    uint32_t index = (uint32_t)dag->count;
+    if (!dag_append(dag, node)) return QT_DAG_NONE;
+    table->slots[slot] = index + 1;
+    return index;
+}
+
+// Interns node's subtree children first, checking that it follows
+// split_region as in linear_from_node.
+static int dag_from_node(QTDag *dag, QTDagTable *table, QTNode *node, QTRegion region,
+                         uint32_t *index) {
+    if (node->row != region.row || node->col != region.col ||
+        node->height != region.height || node->width != region.width) {
+        return 0;
+    }
+
+    QTDagNode shared = {{QT_DAG_NONE, QT_DAG_NONE, QT_DAG_NONE, QT_DAG_NONE}, node->intensity};
+    QTNode *nodes[4] = {node->child1, node->child2, node->child3, node->child4};
+    if (nodes[0] || nodes[1] || nodes[2] || nodes[3]) {
+        QTRegion children[4];
+        split_region(region, children);
+        for (int k = 0; k < 4; k++) {
+            if ((children[k].height > 0) != (nodes[k] != NULL)) return 0;
+            if (nodes[k] && !dag_from_node(dag, table, nodes[k], children[k], &shared.child[k])) {
+                return 0;
+            }
+        }
+    }
+
+    *index = dag_intern(dag, table, shared);
+    return *index != QT_DAG_NONE;
+}
+
+QTDag *dag_from_quadtree(QTNode *root) {
+    if (!root) return NULL;
+
+    QTDag *dag = calloc(1, sizeof(QTDag));
+    if (!dag) return NULL;
+    dag->width = root->width;
+    dag->height = root->height;
+
+    QTDagTable table = {NULL, 0};
+    QTRegion whole = {0, 0, root->height, root->width};
+    uint32_t index;
+    int ok = dag_from_node(dag, &table, root, whole, &index);
+    free(table.slots);
+
+    if (!ok) {
+        delete_dag_quadtree(dag);
+        return NULL;
+    }
+    return dag;
+}
+
+void delete_dag_quadtree(QTDag *dag) {
+    if (!dag) return;
+    free(dag->nodes);
+    free(dag);
+}
+
+// Splits region for the node at index. Returns -1 for a leaf, 1 when the
+// node's children match split_region(region) and 0 when they do not, which
+// only a corrupt file can cause.
+static int dag_children(QTDag *dag, uint32_t index, QTRegion region, QTRegion children[4]) {
+    const uint32_t *child = dag->nodes[index].child;
+    if (child[0] == QT_DAG_NONE && child[1] == QT_DAG_NONE &&
+        child[2] == QT_DAG_NONE && child[3] == QT_DAG_NONE) {
+        return -1;
+    }
+
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if ((children[k].height > 0) != (child[k] != QT_DAG_NONE)) return 0;
+    }
+    return 1;
+}
+
+static QTNode *node_from_dag(QTDag *dag, uint32_t index, QTRegion region,
+                             QTArenaCursor *cursor) {
+    QTRegion children[4];
+    int split = dag_children(dag, index, region, children);
+    if (split == 0) return NULL;
+
+    QTNode *node = arena_alloc_node(cursor);
+    if (!node) return NULL;
+
+    node->intensity = dag->nodes[index].intensity;
+    node->row = region.row;
+    node->col = region.col;
+    node->height = region.height;
+    node->width = region.width;
+    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
+    if (split < 0) return node;
+
+    QTNode **slots[4] = {&node->child1, &node->child2, &node->child3, &node->child4};
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        *slots[k] = node_from_dag(dag, dag->nodes[index].child[k], children[k], cursor);
+        if (!*slots[k]) return NULL;
+    }
+    return node;
+}
+
+QTNode *quadtree_from_dag(QTDag *dag) {
+    if (!dag || dag->count == 0) return NULL;
+
+    QTArena *arena = arena_create();
+    if (!arena) return NULL;
+
+    QTArenaCursor cursor;
+    arena_cursor_init(&cursor, arena);
+    QTRegion whole = {0, 0, dag->height, dag->width};
+    QTNode *root = node_from_dag(dag, (uint32_t)(dag->count - 1), whole, &cursor);
+    if (!root) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    return root;
+}
+
+static int render_dag_node(QTDag *dag, uint32_t index, QTRegion region, QTRaster *raster) {
+    QTRegion children[4];
+    int split = dag_children(dag, index, region, children);
+    if (split < 0) return paint_leaf(raster, region, dag->nodes[index].intensity);
+    if (split == 0) return 0;
+
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        if (!render_dag_node(dag, dag->nodes[index].child[k], children[k], raster)) return 0;
+    }
+    return 1;
+}
+
+int save_dag_qtree_as_pnm(QTDag *dag, char *filename, PNMFormat format) {
+    if (!dag || dag->count == 0 || !filename) return 0;
+
+    QTRaster raster = {NULL, dag->width, dag->height};
+    raster.pixels = calloc((size_t)dag->width * dag->height, sizeof(unsigned char));
+    if (!raster.pixels) return 0;
+
+    QTRegion whole = {0, 0, dag->height, dag->width};
+    int ok = render_dag_node(dag, (uint32_t)(dag->count - 1), whole, &raster) &&
+             save_pnm(filename, raster.pixels, raster.width, raster.height, format);
+    free(raster.pixels);
+    return ok;
+}
+
+// LEB128: seven bits per byte, low bits first, high bit set on all but the
+// last byte.
+static int read_varint(FILE *fp, uint32_t *value) {
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int byte = fgetc(fp);
+        if (byte == EOF) return 0;
+        if (shift == 28 && (byte & 0x70)) return 0;     // More than 32 bits
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void dag_writer_put(QTDagWriter *writer, int kind, uint32_t payload) {
+    writer->kinds |= (unsigned char)(kind << (2 * writer->count));
+    if (kind == QT_DAG_REF) {
+        while (payload >= 0x80) {
+            writer->payload[writer->size++] = (unsigned char)((payload & 0x7F) | 0x80);
+            payload >>= 7;
+        }
+    }
+    writer->payload[writer->size++] = (unsigned char)payload;
+    if (++writer->count == 4) dag_writer_flush(writer);
+}
+
+static void dag_writer_flush(QTDagWriter *writer) {
+    if (writer->count == 0) return;
+    fputc(writer->kinds, writer->fp);
+    fwrite(writer->payload, 1, (size_t)writer->size, writer->fp);
+    writer->kinds = 0;
+    writer->size = 0;
+    writer->count = 0;
+}
+
+static int dag_reader_get(QTDagReader *reader, int *kind, uint32_t *payload) {
+    if (reader->index == 4) {
+        int kinds = getc(reader->fp);
+        if (kinds == EOF) return 0;
+        reader->kinds = (unsigned char)kinds;
+        reader->index = 0;
+    }
+
+    *kind = (reader->kinds >> (2 * reader->index)) & 3;
+    reader->index++;
+    if (*kind == QT_DAG_REF) return read_varint(reader->fp, payload);
+
+    int value = getc(reader->fp);
+    if (value == EOF) return 0;
+    *payload = (uint32_t)value;
+    return 1;
+}
+
+static int save_dag_node(QTDag *dag, uint32_t index, QTRegion region, QTDagWriter *writer) {
+    QTRegion children[4];
+    int split = dag_children(dag, index, region, children);
+    if (split == 0) return 0;
+    if (split < 0) {
+        dag_writer_put(writer, QT_DAG_LEAF, dag->nodes[index].intensity);
+        return 1;
+    }
+    QTDagNumbered *numbered = &writer->numbers[index];
+    if (numbered->value != QT_DAG_NONE && numbered->height == region.height &&
+        numbered->width == region.width) {
+        dag_writer_put(writer, QT_DAG_REF, numbered->value);
+        return 1;
+    }
+
+    uint32_t number = writer->next_number++;
+    if (numbered->value == QT_DAG_NONE) {
+        *numbered = (QTDagNumbered){number, region.height, region.width};
+    }
+    dag_writer_put(writer, QT_DAG_SPLIT, dag->nodes[index].intensity);
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        if (!save_dag_node(dag, dag->nodes[index].child[k], children[k], writer)) return 0;
+    }
+    return 1;
+}
+
+int save_dag_qtree(QTDag *dag, char *filename) {
+    if (!dag || dag->count == 0 || !filename) return 0;
+
+    QTDagWriter writer = {NULL, 0, {0}, 0, 0, malloc(dag->count * sizeof(QTDagNumbered)), 0};
+    if (!writer.numbers) return 0;
+    for (size_t i = 0; i < dag->count; i++) writer.numbers[i].value = QT_DAG_NONE;
+
+    writer.fp = fopen(filename, "wb");
+    if (!writer.fp) {
+        free(writer.numbers);
+        return 0;
+    }
+
+    fwrite(QT_DAG_MAGIC, 1, 4, writer.fp);
+    write_u32(writer.fp, dag->width);
+    write_u32(writer.fp, dag->height);
+
+    QTRegion whole = {0, 0, dag->height, dag->width};
+    int ok = save_dag_node(dag, (uint32_t)(dag->count - 1), whole, &writer);
+    dag_writer_flush(&writer);
+    free(writer.numbers);
+
+    if (ferror(writer.fp)) ok = 0;
+    if (fclose(writer.fp) != 0) ok = 0;
+    return ok;
+}
+
+// Reads the subtree for region and interns it, so the DAG comes out merged
+// even if the file repeats a subtree instead of referring back to it.
+static int load_dag_node(QTDagReader *reader, QTRegion region, uint32_t *index) {
+    int kind;
+    uint32_t payload;
+    if (!dag_reader_get(reader, &kind, &payload)) return 0;
+
+    QTRegion children[4];
+    if (kind == QT_DAG_REF) {
+        // Only internal nodes written in full before this point, for a region
+        // of this size, so that their whole subtree fits it
+        if (payload >= reader->count) return 0;
+        QTDagNumbered numbered = reader->nodes[payload];
+        if (numbered.value == QT_DAG_NONE || numbered.height != region.height ||
+            numbered.width != region.width) {
+            return 0;
+        }
+        *index = numbered.value;
+        return 1;
+    }
+
+    QTDagNode node = {{QT_DAG_NONE, QT_DAG_NONE, QT_DAG_NONE, QT_DAG_NONE},
+                      (unsigned char)payload};
+    if (kind == QT_DAG_SPLIT) {
+        split_region(region, children);
+        if (children[0].height == 0) return 0;  // A single pixel cannot split
+
+        if (reader->count == reader->capacity) {
+            size_t capacity = reader->capacity ? reader->capacity * 2 : 1024;
+            QTDagNumbered *nodes = realloc(reader->nodes, capacity * sizeof(QTDagNumbered));
+            if (!nodes) return 0;
+            reader->nodes = nodes;
+            reader->capacity = capacity;
+        }
+        size_t number = reader->count++;
+        reader->nodes[number] = (QTDagNumbered){QT_DAG_NONE, region.height, region.width};
+
+        for (int k = 0; k < 4; k++) {
+            if (children[k].height == 0) continue;
+            if (!load_dag_node(reader, children[k], &node.child[k])) return 0;
+        }
+        *index = dag_intern(reader->dag, &reader->table, node);
+        reader->nodes[number].value = *index;
+        return *index != QT_DAG_NONE;
+    }
+    if (kind != QT_DAG_LEAF) return 0;
+
+    *index = dag_intern(reader->dag, &reader->table, node);
+    return *index != QT_DAG_NONE;
+}
+
+QTDag *load_dag_qtree(char *filename) {
+    if (!filename) return NULL;
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+
+    char magic[4];
+    uint32_t width, height;
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, QT_DAG_MAGIC, 4) != 0 ||
+        !read_u32(fp, &width) || !read_u32(fp, &height) || width == 0 || height == 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    QTDag *dag = calloc(1, sizeof(QTDag));
+    if (!dag) {
+        fclose(fp);
+        return NULL;
+    }
+    dag->width = width;
+    dag->height = height;
+
+    QTDagReader reader = {fp, 0, 4, dag, NULL, 0, 0, {NULL, 0}};
+    QTRegion whole = {0, 0, height, width};
+    uint32_t root;
+    int ok = load_dag_node(&reader, whole, &root) && root == dag->count - 1;
+    free(reader.nodes);
+    free(reader.table.slots);
+    fclose(fp);
 
-static double calculate_rmse(Image *image, unsigned int start_row, 
-                           unsigned int start_col, unsigned int height,
-                           unsigned int width, double avg_intensity) {
-    if (!image) return 0.0;
-    
-    double sum_squared_diff = 0.0;
-    int count = 0;
-    
-    for (unsigned int i = start_row; i < start_row + height; i++) {
-        for (unsigned int j = start_col; j < start_col + width; j++) {
-            if (i < image->height && j < image->width) {
-                double intensity = get_image_intensity(image, i, j);
-                double diff = intensity - avg_intensity;
-                sum_squared_diff += diff * diff;
-                count++;
-            }
-        }
+    if (!ok) {
+        delete_dag_quadtree(dag);
+        return NULL;
     }
-    
-    return (count > 0) ? sqrt(sum_squared_diff / count) : 0.0;
+    return dag;
 }
 
-static double calculate_average_intensity(Image *image, unsigned int start_row,
-                                       unsigned int start_col, unsigned int height,
-                                       unsigned int width) {
-    if (!image) return 0.0;
-    
-    double sum = 0.0;
-    int count = 0;
-    
-    for (unsigned int i = start_row; i < start_row + height; i++) {
-        for (unsigned int j = start_col; j < start_col + width; j++) {
-            if (i < image->height && j < image->width) {
-                sum += get_image_intensity(image, i, j);
-                count++;
-            }
-        }
-    }
-    
-    return (count > 0) ? sum / count : 0.0;
-}
+// Appends nodes [first, first + count) of source. Subtree sizes are
+// relative, so a whole subtree copies as is.
+static int linear_append_range(QTLinearTree *tree, QTLinearTree *source, size_t first,
+                               size_t count) {
+    if (count > UINT32_MAX - tree->count) return 0;
+    if (tree->count + count > tree->capacity) {
+        size_t capacity = tree->capacity ? tree->capacity : 1024;
+        while (capacity < tree->count + count) capacity *= 2;
+        unsigned char *intensities = realloc(tree->intensity, capacity);
+        if (!intensities) return 0;
+        tree->intensity = intensities;
 
-static QTNode *create_node(Image *image, unsigned int row, unsigned int col,
-                          unsigned int height, unsigned int width, double max_rmse) {
-    if (!image || height == 0 || width == 0) return NULL;
-    
-    QTNode *node = malloc(sizeof(QTNode));
-    if (!node) return NULL;
-    
-    node->row = row;
-    node->col = col;
-    node->height = height;
-    node->width = width;
-    node->child1 = node->child2 = node->child3 = node->child4 = NULL;
-    
-    double avg = calculate_average_intensity(image, row, col, height, width);
-    node->intensity = (unsigned char)avg;  // Proper rounding
-    
-    double rmse = calculate_rmse(image, row, col, height, width, avg);
-    
-    if (rmse > max_rmse) {
-        // Handle single row/column cases specially
-        if (height == 1) {
-            unsigned int half_width = width / 2;
-            if (half_width > 0) {
-                node->child1 = create_node(image, row, col,
-                                         height, half_width, max_rmse);
-                node->child2 = create_node(image, row, col + half_width,
-                                         height, width - half_width, max_rmse);
-            }
-        }
-        else if (width == 1) {
-            unsigned int half_height = height / 2;
-            if (half_height > 0) {
-                node->child1 = create_node(image, row, col,
-                                         half_height, width, max_rmse);
-                node->child3 = create_node(image, row + half_height, col,
-                                         height - half_height, width, max_rmse);
-            }
-        }
-        else {
-            unsigned int half_height = height / 2;
-            unsigned int half_width = width / 2;
-            
-            if (half_height > 0 && half_width > 0) {
-                node->child1 = create_node(image, row, col,
-                                         half_height, half_width, max_rmse);
-                node->child2 = create_node(image, row, col + half_width,
-                                         half_height, width - half_width, max_rmse);
-                node->child3 = create_node(image, row + half_height, col,
-                                         height - half_height, half_width, max_rmse);
-                node->child4 = create_node(image, row + half_height, col + half_width,
-                                         height - half_height, width - half_width, max_rmse);
-            }
-        }
+        uint32_t *subtree = realloc(tree->subtree, capacity * sizeof(uint32_t));
+        if (!subtree) return 0;
+        tree->subtree = subtree;
+        tree->capacity = capacity;
     }
-    
-    return node;
+
+    memcpy(tree->intensity + tree->count, source->intensity + first, count);
+    memcpy(tree->subtree + tree->count, source->subtree + first, count * sizeof(uint32_t));
+    tree->count += count;
+    return 1;
 }
 
-QTNode *create_quadtree(Image *image, double max_rmse) {
-    if (!image || max_rmse < 0) return NULL;
-    return create_node(image, 0, 0, get_image_height(image), 
-                      get_image_width(image), max_rmse);
+// Subtrees at the same place of two trees of one size are equal exactly when
+// their preorder arrays are.
+static int linear_subtree_equal(QTLinearTree *a, size_t a_index, QTLinearTree *b,
+                                size_t b_index) {
+    size_t count = a->subtree[a_index];
+    return count == b->subtree[b_index] &&
+           memcmp(a->intensity + a_index, b->intensity + b_index, count) == 0 &&
+           memcmp(a->subtree + a_index, b->subtree + b_index, count * sizeof(uint32_t)) == 0;
 }
 
-QTNode *get_child1(QTNode *node) { return node ? node->child1 : NULL; }
-QTNode *get_child2(QTNode *node) { return node ? node->child2 : NULL; }
-QTNode *get_child3(QTNode *node) { return node ? node->child3 : NULL; }
-QTNode *get_child4(QTNode *node) { return node ? node->child4 : NULL; }
+static void delta_put(QTSequenceWriter *writer, int op, int has_intensity,
+                      unsigned char intensity) {
+    writer->ops |= (unsigned char)(op << (2 * writer->count));
+    if (has_intensity) writer->payload[writer->size++] = intensity;
+    if (++writer->count == 4) delta_flush(writer);
+}
 
-unsigned char get_node_intensity(QTNode *node) {
-    return node ? node->intensity : 0;
+static void delta_flush(QTSequenceWriter *writer) {
+    if (writer->count == 0) return;
+    fputc(writer->ops, writer->fp);
+    fwrite(writer->payload, 1, (size_t)writer->size, writer->fp);
+    writer->ops = 0;
+    writer->size = 0;
+    writer->count = 0;
 }
 
-void delete_quadtree(QTNode *root) {
-    if (!root) return;
-    
-    delete_quadtree(root->child1);
-    delete_quadtree(root->child2);
-    delete_quadtree(root->child3);
-    delete_quadtree(root->child4);
-    
-    free(root);
+static int delta_get(QTSequenceReader *reader, int *op, unsigned char *intensity) {
+    if (reader->index == 4) {
+        int ops = getc(reader->fp);
+        if (ops == EOF) return 0;
+        reader->ops = (unsigned char)ops;
+        reader->index = 0;
+    }
+
+    *op = (reader->ops >> (2 * reader->index)) & 3;
+    reader->index++;
+    if (*op == QT_DELTA_LEAF || *op == QT_DELTA_SPLIT) {
+        int value = getc(reader->fp);
+        if (value == EOF) return 0;
+        *intensity = (unsigned char)value;
+    }
+    return 1;
 }
 
-static void fill_pixels_from_qtree(QTNode *node, unsigned char *pixels, unsigned int image_width) {
-    if (!node || !pixels) return;
-    
-    // If leaf node, fill region with node's intensity
-    if (!node->child1 && !node->child2 && !node->child3 && !node->child4) {
-        for (unsigned int i = node->row; i < node->row + node->height; i++) {
-            for (unsigned int j = node->col; j < node->col + node->width; j++) {
-                pixels[i * image_width + j] = node->intensity;
-            }
-        }
+// Codes the subtree at index against the previous frame's node at the same
+// place, if there is one (previous is QT_LINEAR_NONE otherwise).
+static void write_delta_node(QTSequenceWriter *writer, QTLinearTree *tree, size_t index,
+                             size_t previous, QTRegion region) {
+    QTLinearTree *old = writer->previous;
+    unsigned char intensity = tree->intensity[index];
+    if (previous != QT_LINEAR_NONE && linear_subtree_equal(tree, index, old, previous)) {
+        delta_put(writer, QT_DELTA_KEEP, 0, 0);
         return;
     }
-    
-    // Recursively fill children's regions
-    if (node->child1) fill_pixels_from_qtree(node->child1, pixels, image_width);
-    if (node->child2) fill_pixels_from_qtree(node->child2, pixels, image_width);
-    if (node->child3) fill_pixels_from_qtree(node->child3, pixels, image_width);
-    if (node->child4) fill_pixels_from_qtree(node->child4, pixels, image_width);
+    if (tree->subtree[index] == 1) {
+        delta_put(writer, QT_DELTA_LEAF, 1, intensity);
+        return;
+    }
+
+    int same = previous != QT_LINEAR_NONE && old->subtree[previous] > 1 &&
+               old->intensity[previous] == intensity;
+    if (same) delta_put(writer, QT_DELTA_SPLIT_SAME, 0, 0);
+    else delta_put(writer, QT_DELTA_SPLIT, 1, intensity);
+
+    // Children line up with the previous node's when it was split too
+    int old_split = previous != QT_LINEAR_NONE && old->subtree[previous] > 1;
+    size_t child = index + 1;
+    size_t old_child = old_split ? previous + 1 : QT_LINEAR_NONE;
+    QTRegion children[4];
+    split_region(region, children);
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        write_delta_node(writer, tree, child, old_child, children[k]);
+        child += tree->subtree[child];
+        if (old_split) old_child += old->subtree[old_child];
+    }
 }
 
-void save_qtree_as_ppm(QTNode *root, char *filename) {
-    if (!root || !filename) return;
-    
-    FILE *fp = fopen(filename, "w");
-    if (!fp) return;
-    
-    // Write PPM header
-    fprintf(fp, "P3\n%u %u\n255\n", root->width, root->height);
-    
-    // Create temporary buffer for pixel data
-    unsigned char *pixels = calloc(root->width * root->height, sizeof(unsigned char));
-    if (!pixels) {
-        fclose(fp);
-        return;
+QTSequenceWriter *open_qtree_sequence_writer(char *filename, unsigned int width,
+                                             unsigned int height) {
+    if (!filename || width == 0 || height == 0) return NULL;
+
+    QTSequenceWriter *writer = calloc(1, sizeof(QTSequenceWriter));
+    if (!writer) return NULL;
+    writer->fp = fopen(filename, "wb");
+    if (!writer->fp) {
+        free(writer);
+        return NULL;
     }
-    
-    // Fill buffer with intensities
-    fill_pixels_from_qtree(root, pixels, root->width);
-    
-    // Write pixel data
-    for (unsigned int i = 0; i < root->height * root->width; i++) {
-        unsigned char intensity = pixels[i];
-        fprintf(fp, "%u %u %u ", intensity, intensity, intensity);
-        if ((i + 1) % root->width == 0) fprintf(fp, "\n");
+
+    fwrite(QT_SEQUENCE_MAGIC, 1, 4, writer->fp);
+    write_u32(writer->fp, width);
+    write_u32(writer->fp, height);
+
+    // Frames are checked against the size through this empty tree until the
+    // first one replaces it
+    writer->previous = alloc_linear_tree(width, height);
+    if (!writer->previous) {
+        fclose(writer->fp);
+        free(writer);
+        return NULL;
     }
-    
-    free(pixels);
-    fclose(fp);
+    return writer;
 }
 
-static void save_preorder_qt_recursive(QTNode *node, FILE *fp) {
-    if (!node || !fp) return;
-    
-    char type = (node->child1 || node->child2 || node->child3 || node->child4) ? 'N' : 'L';
-    
-    fprintf(fp, "%c %u %u %u %u %u\n", 
-            type,
-            node->intensity,
-            node->row,
-            node->height,
-            node->col,
-            node->width);
-    
-    if (type == 'N') {
-        if (node->child1) save_preorder_qt_recursive(node->child1, fp);
-        if (node->child2) save_preorder_qt_recursive(node->child2, fp);
-        if (node->child3) save_preorder_qt_recursive(node->child3, fp);
-        if (node->child4) save_preorder_qt_recursive(node->child4, fp);
+int write_qtree_sequence_frame(QTSequenceWriter *writer, QTNode *root) {
+    if (!writer || !root) return 0;
+    if (root->width != writer->previous->width || root->height != writer->previous->height) {
+        return 0;
     }
+
+    QTLinearTree *tree = linear_from_quadtree(root);
+    if (!tree) return 0;
+
+    QTRegion whole = {0, 0, tree->height, tree->width};
+    write_delta_node(writer, tree, 0, writer->previous->count ? 0 : QT_LINEAR_NONE, whole);
+    delta_flush(writer);
+
+    delete_linear_quadtree(writer->previous);
+    writer->previous = tree;
+    return !ferror(writer->fp);
 }
 
-void save_preorder_qt(QTNode *root, char *filename) {
-    if (!root || !filename) return;
-    
-    FILE *fp = fopen(filename, "w");
-    if (!fp) return;
-    
-    save_preorder_qt_recursive(root, fp);
-    fclose(fp);
+int close_qtree_sequence_writer(QTSequenceWriter *writer) {
+    if (!writer) return 0;
+
+    int ok = !ferror(writer->fp);
+    if (fclose(writer->fp) != 0) ok = 0;
+    delete_linear_quadtree(writer->previous);
+    free(writer);
+    return ok;
+}
+
+// Appends the subtree for region to the frame being decoded, copying what
+// the previous frame's node at the same place (if any) keeps.
+static int read_delta_node(QTSequenceReader *reader, size_t previous, QTRegion region) {
+    QTLinearTree *tree = reader->current;
+    QTLinearTree *old = reader->previous;
+    int op;
+    unsigned char intensity = 0;
+    if (!delta_get(reader, &op, &intensity)) return 0;
+
+    if (op == QT_DELTA_KEEP) {
+        return previous != QT_LINEAR_NONE &&
+               linear_append_range(tree, old, previous, old->subtree[previous]);
+    }
+    if (op == QT_DELTA_LEAF) return linear_append(tree, intensity);
+
+    int old_split = previous != QT_LINEAR_NONE && old->subtree[previous] > 1;
+    if (op == QT_DELTA_SPLIT_SAME) {
+        if (!old_split) return 0;
+        intensity = old->intensity[previous];
+    }
+
+    QTRegion children[4];
+    split_region(region, children);
+    if (children[0].height == 0) return 0;  // A single pixel cannot split
+
+    size_t index = tree->count;
+    if (!linear_append(tree, intensity)) return 0;
+    size_t old_child = old_split ? previous + 1 : QT_LINEAR_NONE;
+    for (int k = 0; k < 4; k++) {
+        if (children[k].height == 0) continue;
+        if (!read_delta_node(reader, old_child, children[k])) return 0;
+        if (old_split) old_child += old->subtree[old_child];
+    }
+    tree->subtree[index] = (uint32_t)(tree->count - index);
+    return 1;
 }
 
-static QTNode *load_preorder_qt_recursive(FILE *fp) {
+QTSequenceReader *open_qtree_sequence_reader(char *filename) {
+    if (!filename) return NULL;
+
+    FILE *fp = fopen(filename, "rb");
     if (!fp) return NULL;
-    
-    char type;
-    unsigned int intensity, row, height, col, width;
-    
-    // Read the node data
-    if (fscanf(fp, " %c %u %u %u %u %u", 
-               &type, &intensity, &row, &height, &col, &width) != 6) {
+
+    char magic[4];
+    uint32_t width, height;
+    if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, QT_SEQUENCE_MAGIC, 4) != 0 ||
+        !read_u32(fp, &width) || !read_u32(fp, &height) || width == 0 || height == 0) {
+        fclose(fp);
         return NULL;
     }
-    
-    // Skip remaining characters until newline
-    int c;
-    while ((c = fgetc(fp)) != EOF && c != '\n');
-    
-    // Create and initialize node
-    QTNode *node = malloc(sizeof(QTNode));
-    if (!node) return NULL;
-    
-    node->intensity = intensity;
-    node->row = row;
-    node->height = height;
-    node->col = col;
-    node->width = width;
-    node->child1 = NULL;
-    node->child2 = NULL;
-    node->child3 = NULL;
-    node->child4 = NULL;
-    
-    // For internal nodes, load children based on the same pattern as create_node uses
-    if (type == 'N') {
-        if (height == 1) {
-            // Single row case
-            node->child1 = load_preorder_qt_recursive(fp);
-            node->child2 = load_preorder_qt_recursive(fp);
-        }
-        else if (width == 1) {
-            // Single column case
-            node->child1 = load_preorder_qt_recursive(fp);
-            node->child3 = load_preorder_qt_recursive(fp);
-        }
-        else {
-            // Regular case - load all four children
-            node->child1 = load_preorder_qt_recursive(fp);
-            node->child2 = load_preorder_qt_recursive(fp);
-            node->child3 = load_preorder_qt_recursive(fp);
-            node->child4 = load_preorder_qt_recursive(fp);
-        }
-        
-        // If we failed to load any expected children, clean up and return NULL
-        if (height == 1 && (!node->child1 || !node->child2)) {
-            delete_quadtree(node);
-            return NULL;
+
+    QTSequenceReader *reader = calloc(1, sizeof(QTSequenceReader));
+    if (!reader) {
+        fclose(fp);
+        return NULL;
+    }
+    reader->fp = fp;
+    reader->width = width;
+    reader->height = height;
+    reader->index = 4;
+    return reader;
+}
+
+QTLinearTree *read_qtree_sequence_frame(QTSequenceReader *reader) {
+    if (!reader || !reader->fp) return NULL;
+
+    // A clean end of file can only come before a frame's first group
+    int next = getc(reader->fp);
+    if (next == EOF) return NULL;
+    ungetc(next, reader->fp);
+
+    delete_linear_quadtree(reader->current);
+    reader->current = alloc_linear_tree(reader->width, reader->height);
+    QTRegion whole = {0, 0, reader->height, reader->width};
+    reader->index = 4;
+    int ok = reader->current != NULL &&
+             read_delta_node(reader, reader->previous ? 0 : QT_LINEAR_NONE, whole);
+    if (!ok) {
+        // Nothing after a corrupt frame can be decoded
+        fclose(reader->fp);
+        reader->fp = NULL;
+        return NULL;
+    }
+
+    QTLinearTree *frame = reader->current;
+    reader->current = reader->previous;
+    reader->previous = frame;
+    return frame;
+}
+
+void close_qtree_sequence_reader(QTSequenceReader *reader) {
+    if (!reader) return;
+    if (reader->fp) fclose(reader->fp);
+    delete_linear_quadtree(reader->previous);
+    delete_linear_quadtree(reader->current);
+    free(reader);
+}
+
+static unsigned int residual_magnitude(unsigned char residual) {
+    int value = (signed char)residual;
+    return (unsigned int)(value < 0 ? -value : value);
+}
+
+// Context of the residual at col from its left and upper neighbours; above
+// is NULL on the first row.
+static unsigned int residual_context(const unsigned char *row, const unsigned char *above,
+                                     unsigned int col) {
+    unsigned int activity = (col > 0 ? residual_magnitude(row[col - 1]) : 0) +
+                            (above ? residual_magnitude(above[col]) : 0);
+    unsigned int context = 0;
+    while (activity > 0 && context < QT_RESIDUAL_CONTEXTS - 1) {
+        activity >>= 1;
+        context++;
+    }
+    return context;
+}
+
+// Median edge detector over the left, upper and upper-left residuals, which
+// inside a leaf follow the image's own gradients.
+static unsigned char predict_residual(const unsigned char *row, const unsigned char *above,
+                                      unsigned int col) {
+    int left = col > 0 ? (signed char)row[col - 1] : 0;
+    int up = above ? (signed char)above[col] : 0;
+    int corner = above && col > 0 ? (signed char)above[col - 1] : 0;
+    if (!above) return (unsigned char)left;
+    if (col == 0) return (unsigned char)up;
+
+    int low = left < up ? left : up;
+    int high = left < up ? up : left;
+    if (corner >= high) return (unsigned char)low;
+    if (corner <= low) return (unsigned char)high;
+    return (unsigned char)(left + up - corner);
+}
+
+static unsigned int zigzag_residual(unsigned char residual) {
+    int value = (signed char)residual;
+    return value >= 0 ? (unsigned int)value * 2 : (unsigned int)(-value) * 2 - 1;
+}
+
+static unsigned char unzigzag_residual(unsigned int symbol) {
+    return (unsigned char)(symbol & 1 ? -(int)((symbol + 1) / 2) : (int)(symbol / 2));
+}
+
+// File: the magic, width and height, then one range-coded stream holding the
+// base tree as in save_preorder_qt_compressed followed by the residuals in
+// row-major order.
+int save_lossless_qt(Image *image, double max_rmse, char *filename) {
+    if (!image || max_rmse < 0 || !filename) return 0;
+
+    unsigned int width = get_image_width(image);
+    unsigned int height = get_image_height(image);
+    QTNode *root = create_quadtree(image, max_rmse);
+    if (!root) return 0;
+
+    unsigned char *base = malloc((size_t)width * height);
+    unsigned char *rows = malloc(2 * (size_t)width);
+    QTResidualModel *residuals = malloc(sizeof(QTResidualModel));
+    QTCodedModel model;
+    RangeEncoder encoder;
+    init_coded_model(&model);
+    rc_encoder_init(&encoder);
+
+    QTRegion whole = {0, 0, height, width};
+    int ok = base && rows && residuals && qtree_render(root, base, width) &&
+             encode_coded_node(&model, &encoder, root, whole, 0, 128, 0);
+    delete_quadtree(root);
+
+    if (ok) {
+        rc_init_probs(&residuals->residual[0][0], QT_RESIDUAL_CONTEXTS * 256);
+        unsigned char *above = NULL;
+        for (unsigned int i = 0; i < height; i++) {
+            unsigned char *row = rows + (size_t)(i % 2) * width;
+            const unsigned char *base_row = base + (size_t)i * width;
+            get_image_row(image, i, row);
+            for (unsigned int j = 0; j < width; j++) {
+                row[j] = (unsigned char)(row[j] - base_row[j]);
+                unsigned char error = (unsigned char)(row[j] - predict_residual(row, above, j));
+                rc_encode_tree(&encoder, residuals->residual[residual_context(row, above, j)],
+                               8, zigzag_residual(error));
+            }
+            above = row;
         }
-        if (width == 1 && (!node->child1 || !node->child3)) {
-            delete_quadtree(node);
-            return NULL;
+        ok = rc_encoder_finish(&encoder);
+    }
+    free(base);
+    free(rows);
+    free(residuals);
+
+    FILE *fp = ok ? fopen(filename, "wb") : NULL;
+    if (!fp) {
+        rc_encoder_free(&encoder);
+        return 0;
+    }
+
+    fwrite(QT_LOSSLESS_MAGIC, 1, 4, fp);
+    write_u32(fp, width);
+    write_u32(fp, height);
+    fwrite(encoder.data, 1, encoder.size, fp);
+    rc_encoder_free(&encoder);
+
+    ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = 0;
+    return ok;
+}
+
+// Decodes the base tree into *base when base is set, and otherwise the
+// whole image.
+static Image *decode_lossless(char *filename, QTNode **base) {
+    if (!filename) return NULL;
+
+    size_t size;
+    unsigned char *data = read_file(filename, &size);
+    if (!data) return NULL;
+
+    uint32_t width = 0, height = 0;
+    if (size >= 12 && memcmp(data, QT_LOSSLESS_MAGIC, 4) == 0) {
+        for (int i = 3; i >= 0; i--) {
+            width = (width << 8) | data[4 + i];
+            height = (height << 8) | data[8 + i];
         }
-        if (height > 1 && width > 1 && 
-            (!node->child1 || !node->child2 || !node->child3 || !node->child4)) {
-            delete_quadtree(node);
-            return NULL;
+    }
+
+    QTArena *arena = (width && height) ? arena_create() : NULL;
+    if (!arena) {
+        free(data);
+        return NULL;
+    }
+
+    QTCodedModel model;
+    RangeDecoder decoder;
+    QTArenaCursor cursor;
+    init_coded_model(&model);
+    rc_decoder_init(&decoder, data + 12, size - 12);
+    arena_cursor_init(&cursor, arena);
+
+    QTRegion whole = {0, 0, height, width};
+    QTNode *root = decode_coded_node(&model, &decoder, &cursor, whole, 0, 128, 0);
+    if (!root || decoder.overrun) {
+        free(data);
+        arena_destroy(arena);
+        return NULL;
+    }
+    if (base) {
+        free(data);
+        *base = root;
+        return NULL;
+    }
+
+    Image *image = create_image(width, height);
+    unsigned char *rows = malloc(2 * (size_t)width);
+    QTResidualModel *residuals = malloc(sizeof(QTResidualModel));
+    int ok = image && rows && residuals && qtree_render(root, image->pixels, width);
+    delete_quadtree(root);
+
+    if (ok) {
+        rc_init_probs(&residuals->residual[0][0], QT_RESIDUAL_CONTEXTS * 256);
+        unsigned char *above = NULL;
+        for (unsigned int i = 0; i < height && !decoder.overrun; i++) {
+            unsigned char *row = rows + (size_t)(i % 2) * width;
+            unsigned char *pixels = image->pixels + (size_t)i * width;
+            for (unsigned int j = 0; j < width; j++) {
+                unsigned int symbol = rc_decode_tree(
+                    &decoder, residuals->residual[residual_context(row, above, j)], 8);
+                row[j] = (unsigned char)(unzigzag_residual(symbol) +
+                                         predict_residual(row, above, j));
+                pixels[j] = (unsigned char)(pixels[j] + row[j]);
+            }
+            above = row;
         }
+        ok = !decoder.overrun;
     }
-    
-    return node;
+    free(data);
+    free(rows);
+    free(residuals);
+
+    if (!ok) {
+        delete_image(image);
+        return NULL;
+    }
+    return image;
 }
 
-QTNode *load_preorder_qt(char *filename) {
-    if (!filename) return NULL;
-    
-    FILE *fp = fopen(filename, "r");
-    if (!fp) return NULL;
-    
-    QTNode *root = load_preorder_qt_recursive(fp);
-    fclose(fp);
+Image *load_lossless_qt(char *filename) {
+    return decode_lossless(filename, NULL);
+}
+
+QTNode *load_lossless_qt_base(char *filename) {
+    QTNode *root = NULL;
+    decode_lossless(filename, &root);
     return root;
 }
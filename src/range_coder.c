@@ -0,0 +1,132 @@
+#include "range_coder.h"
+#include <stdlib.h>
+
+#define RC_TOP (1u << 24)
+#define RC_MOVE_BITS 5
+
+void rc_init_probs(RCProb *probs, size_t count) {
+    for (size_t i = 0; i < count; i++) probs[i] = RC_PROB_INIT;
+}
+
+void rc_encoder_init(RangeEncoder *encoder) {
+    encoder->data = NULL;
+    encoder->size = 0;
+    encoder->capacity = 0;
+    encoder->low = 0;
+    encoder->range = 0xFFFFFFFFu;
+    encoder->cache = 0;
+    encoder->cache_size = 1;
+    encoder->failed = 0;
+}
+
+static void encoder_put_byte(RangeEncoder *encoder, unsigned char byte) {
+    if (encoder->size == encoder->capacity) {
+        size_t capacity = encoder->capacity ? encoder->capacity * 2 : 4096;
+        unsigned char *data = realloc(encoder->data, capacity);
+        if (!data) {
+            encoder->failed = 1;
+            return;
+        }
+        encoder->data = data;
+        encoder->capacity = capacity;
+    }
+    encoder->data[encoder->size++] = byte;
+}
+
+// Emits the top byte of low once no later carry can change it. Runs of 0xFF
+// are held back in cache_size until the carry is known.
+static void encoder_shift_low(RangeEncoder *encoder) {
+    if ((uint32_t)encoder->low < 0xFF000000u || (encoder->low >> 32) != 0) {
+        unsigned char carry = (unsigned char)(encoder->low >> 32);
+        unsigned char pending = encoder->cache;
+        do {
+            encoder_put_byte(encoder, (unsigned char)(pending + carry));
+            pending = 0xFF;
+        } while (--encoder->cache_size != 0);
+        encoder->cache = (unsigned char)(encoder->low >> 24);
+    }
+    encoder->cache_size++;
+    encoder->low = (encoder->low & 0x00FFFFFFu) << 8;
+}
+
+void rc_encode_bit(RangeEncoder *encoder, RCProb *prob, int bit) {
+    uint32_t bound = (encoder->range >> RC_PROB_BITS) * *prob;
+    if (!bit) {
+        encoder->range = bound;
+        *prob += ((1 << RC_PROB_BITS) - *prob) >> RC_MOVE_BITS;
+    } else {
+        encoder->low += bound;
+        encoder->range -= bound;
+        *prob -= *prob >> RC_MOVE_BITS;
+    }
+    while (encoder->range < RC_TOP) {
+        encoder->range <<= 8;
+        encoder_shift_low(encoder);
+    }
+}
+
+void rc_encode_tree(RangeEncoder *encoder, RCProb *probs, int nbits, unsigned int value) {
+    unsigned int index = 1;
+    for (int i = nbits - 1; i >= 0; i--) {
+        int bit = (value >> i) & 1;
+        rc_encode_bit(encoder, &probs[index], bit);
+        index = (index << 1) | (unsigned int)bit;
+    }
+}
+
+int rc_encoder_finish(RangeEncoder *encoder) {
+    for (int i = 0; i < 5; i++) encoder_shift_low(encoder);
+    return !encoder->failed;
+}
+
+void rc_encoder_free(RangeEncoder *encoder) {
+    free(encoder->data);
+    encoder->data = NULL;
+    encoder->size = encoder->capacity = 0;
+}
+
+static unsigned char decoder_next_byte(RangeDecoder *decoder) {
+    if (decoder->pos < decoder->size) return decoder->data[decoder->pos++];
+    decoder->overrun = 1;
+    return 0;
+}
+
+void rc_decoder_init(RangeDecoder *decoder, const unsigned char *data, size_t size) {
+    decoder->data = data;
+    decoder->size = size;
+    decoder->pos = 0;
+    decoder->range = 0xFFFFFFFFu;
+    decoder->code = 0;
+    decoder->overrun = 0;
+    for (int i = 0; i < 5; i++) {
+        decoder->code = (decoder->code << 8) | decoder_next_byte(decoder);
+    }
+}
+
+int rc_decode_bit(RangeDecoder *decoder, RCProb *prob) {
+    uint32_t bound = (decoder->range >> RC_PROB_BITS) * *prob;
+    int bit;
+    if (decoder->code < bound) {
+        decoder->range = bound;
+        *prob += ((1 << RC_PROB_BITS) - *prob) >> RC_MOVE_BITS;
+        bit = 0;
+    } else {
+        decoder->code -= bound;
+        decoder->range -= bound;
+        *prob -= *prob >> RC_MOVE_BITS;
+        bit = 1;
+    }
+    while (decoder->range < RC_TOP) {
+        decoder->range <<= 8;
+        decoder->code = (decoder->code << 8) | decoder_next_byte(decoder);
+    }
+    return bit;
+}
+
+unsigned int rc_decode_tree(RangeDecoder *decoder, RCProb *probs, int nbits) {
+    unsigned int index = 1;
+    for (int i = 0; i < nbits; i++) {
+        index = (index << 1) | (unsigned int)rc_decode_bit(decoder, &probs[index]);
+    }
+    return index - (1u << nbits);
+}
@@ -0,0 +1,242 @@
+#include "thread_pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define INITIAL_DEQUE_CAPACITY 64
+
+typedef struct PoolJob {
+    ThreadPoolTask task;
+    void *arg;
+} PoolJob;
+
+// Growable ring buffer. The owner pushes and pops at the bottom; thieves take
+// from the top, so they get the oldest (usually largest) pieces of work.
+typedef struct WorkDeque {
+    pthread_mutex_t lock;
+    PoolJob *jobs;
+    size_t capacity;    // Always a power of two
+    size_t top;         // Index of the oldest job
+    size_t bottom;      // One past the newest job
+} WorkDeque;
+
+typedef struct PoolWorker {
+    ThreadPool *pool;
+    unsigned int index;
+    pthread_t thread;
+    WorkDeque deque;
+} PoolWorker;
+
+struct ThreadPool {
+    PoolWorker *workers;
+    unsigned int nthreads;
+    pthread_mutex_t lock;       // Guards the fields below
+    pthread_cond_t work_ready;
+    pthread_cond_t all_done;
+    size_t queued;              // Jobs sitting in a deque, not yet claimed
+    size_t pending;             // Jobs queued or running
+    unsigned int next_worker;   // Round robin target for outside submissions
+    int shutdown;
+};
+
+// Worker running on this thread, or NULL outside of any pool.
+static _Thread_local PoolWorker *current_worker;
+
+static int deque_init(WorkDeque *deque) {
+    deque->jobs = malloc(INITIAL_DEQUE_CAPACITY * sizeof(PoolJob));
+    if (!deque->jobs) return 0;
+    deque->capacity = INITIAL_DEQUE_CAPACITY;
+    deque->top = deque->bottom = 0;
+    pthread_mutex_init(&deque->lock, NULL);
+    return 1;
+}
+
+static void deque_destroy(WorkDeque *deque) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->jobs);
+}
+
+static int deque_push(WorkDeque *deque, PoolJob job) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity) {
+        size_t capacity = deque->capacity * 2;
+        PoolJob *jobs = malloc(capacity * sizeof(PoolJob));
+        if (!jobs) {
+            pthread_mutex_unlock(&deque->lock);
+            return 0;
+        }
+        for (size_t i = deque->top; i < deque->bottom; i++) {
+            jobs[i & (capacity - 1)] = deque->jobs[i & (deque->capacity - 1)];
+        }
+        free(deque->jobs);
+        deque->jobs = jobs;
+        deque->capacity = capacity;
+    }
+    deque->jobs[deque->bottom & (deque->capacity - 1)] = job;
+    deque->bottom++;
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+static int deque_pop_bottom(WorkDeque *deque, PoolJob *job) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        deque->bottom--;
+        *job = deque->jobs[deque->bottom & (deque->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int deque_steal_top(WorkDeque *deque, PoolJob *job) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *job = deque->jobs[deque->top & (deque->capacity - 1)];
+        deque->top++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int steal_job(ThreadPool *pool, unsigned int thief, PoolJob *job) {
+    for (unsigned int i = 1; i < pool->nthreads; i++) {
+        unsigned int victim = (thief + i) % pool->nthreads;
+        if (deque_steal_top(&pool->workers[victim].deque, job)) return 1;
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    PoolWorker *self = arg;
+    ThreadPool *pool = self->pool;
+    current_worker = self;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->shutdown) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->queued == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        // Claiming a unit of the count guarantees a job is left for us in
+        // some deque, so the search below always terminates.
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        PoolJob job;
+        while (!deque_pop_bottom(&self->deque, &job) &&
+               !steal_job(pool, self->index, &job));
+
+        job.task(job.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) pthread_cond_broadcast(&pool->all_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+ThreadPool *thread_pool_create(unsigned int nthreads) {
+    if (nthreads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = online > 0 ? (unsigned int)online : 1;
+    }
+
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) return NULL;
+
+    pool->workers = calloc(nthreads, sizeof(PoolWorker));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+
+    for (unsigned int i = 0; i < nthreads; i++) {
+        PoolWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        if (!deque_init(&worker->deque)) break;
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            deque_destroy(&worker->deque);
+            break;
+        }
+        pool->nthreads++;
+    }
+
+    if (pool->nthreads < nthreads) {
+        thread_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+unsigned int thread_pool_size(ThreadPool *pool) {
+    return pool ? pool->nthreads : 0;
+}
+
+int thread_pool_worker_index(ThreadPool *pool) {
+    if (!pool || !current_worker || current_worker->pool != pool) return -1;
+    return (int)current_worker->index;
+}
+
+int thread_pool_submit(ThreadPool *pool, ThreadPoolTask task, void *arg) {
+    if (!pool || !task) return 0;
+
+    PoolWorker *target = current_worker;
+    if (!target || target->pool != pool) {
+        pthread_mutex_lock(&pool->lock);
+        target = &pool->workers[pool->next_worker++ % pool->nthreads];
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    PoolJob job = {task, arg};
+    if (!deque_push(&target->deque, job)) return 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+void thread_pool_wait(ThreadPool *pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        deque_destroy(&pool->workers[i].deque);
+    }
+
+    pthread_cond_destroy(&pool->all_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}